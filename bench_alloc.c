@@ -0,0 +1,28 @@
+// Allocation counter for mechsim_bench, loaded into the player with LD_PRELOAD.
+// The player picks up mechsim_alloc_count() through a weak reference.
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long alloc_count = 0;
+
+unsigned long mechsim_alloc_count(void) {
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
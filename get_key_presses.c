@@ -1,46 +1,51 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
 
-#include <poll.h>
-#include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <pthread.h>
 
-#include <libudev.h>
-#include <libinput.h>
 #include <libevdev/libevdev.h>
 
 #include "config.h"
+#include "key_event.h"
+#include "key_input.h"
+#include "key_evdev.h"
+#include "key_trace.h"
 
 #define MAX_BUFFER_LENGTH 512
 
-enum error_code {
-	NO_ERROR,
-	UDEV_FAILED,
-	LIBINPUT_FAILED,
-	SEAT_FAILED,
-	PERMISSION_FAILED
-};
+// Binary output, records are collected and written once per dispatch.
+static bool binary_output = false;
+static struct key_event_record batch[KEY_EVENT_BATCH_MAX];
+static size_t batch_length = 0;
+static uint32_t next_device_id = 1;
 
-struct input_handler_data {
-	struct udev *udev;
-	struct libinput *libinput;
-};
+// --device reads these evdev nodes instead of going through libinput.
+static char *device_paths[KEY_EVDEV_MAX_DEVICES];
+static int num_device_paths = 0;
+static struct key_input input;
+static struct key_evdev evdev;
 
 static void *handle_input(void *user_data)
 {
-	struct input_handler_data *input_handler_data = user_data;
+	(void)user_data;
 
 	char line[MAX_BUFFER_LENGTH];
 	while (fgets(line, MAX_BUFFER_LENGTH, stdin) != NULL) {
 		if (strcmp(line, "stop\n") == 0) {
-			libinput_unref(input_handler_data->libinput);
-			udev_unref(input_handler_data->udev);
+			if (num_device_paths > 0)
+				key_evdev_close(&evdev);
+			else
+				key_input_close(&input);
 			exit(EXIT_SUCCESS);
 		}
 	}
@@ -48,34 +53,113 @@ static void *handle_input(void *user_data)
 	return NULL;
 }
 
-static int open_restricted(const char *path, int flags, void *user_data)
+// With --trace, SIGTERM from the parent exits through atexit so the
+// trace gets flushed.
+static void *handle_signals(void *user_data)
 {
-    (void)user_data;
-	int fd = open(path, flags);
-	if (fd < 0)
-		fprintf(stderr, "Failed to open %s because of %s.\n", path,
-			strerror(errno));
-	return fd < 0 ? -errno : fd;
+	sigset_t *signals = user_data;
+	int sig;
+	if (sigwait(signals, &sig) == 0)
+		exit(EXIT_SUCCESS);
+	return NULL;
 }
 
-static void close_restricted(int fd, void *user_data)
+static int start_tracing(const char *path)
 {
-    (void)user_data;
-	close(fd);
+	static sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_t signal_handler;
+	if (key_trace_open(path, "get_key_presses") != 0 ||
+	    pthread_create(&signal_handler, NULL, handle_signals, &signals) != 0)
+		return -1;
+	key_trace_thread("input");
+	return 0;
 }
 
-static const struct libinput_interface interface = {
-	.open_restricted = open_restricted,
-	.close_restricted = close_restricted,
-};
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t get_device_id(struct libinput_event *event)
+{
+	struct libinput_device *device = libinput_event_get_device(event);
+	uintptr_t id = (uintptr_t)libinput_device_get_user_data(device);
+	if (id == 0) {
+		id = next_device_id++;
+		libinput_device_set_user_data(device, (void *)id);
+	}
+	return (uint32_t)id;
+}
+
+static int flush_records(void)
+{
+	const char *data = (const char *)batch;
+	size_t length = batch_length * KEY_EVENT_RECORD_SIZE;
+
+	// Lets the player measure how long records sat in the pipe.
+	uint64_t sent_usec = monotonic_usec();
+	size_t count = batch_length;
+	for (size_t i = 0; i < batch_length; i++)
+		batch[i].sent_usec = sent_usec;
+	batch_length = 0;
+
+	while (length > 0) {
+		ssize_t written = write(STDOUT_FILENO, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += written;
+		length -= written;
+	}
+
+	if (key_trace_enabled()) {
+		uint64_t done_usec = monotonic_usec();
+		for (size_t i = 0; i < count; i++)
+			key_trace_key("write", sent_usec, done_usec,
+				      batch[i].key_code, batch[i].time_usec);
+	}
+	return 0;
+}
+
+static void queue_record(uint32_t device_id, uint64_t time_usec,
+			 uint32_t key_code, int state_code)
+{
+	if (batch_length == KEY_EVENT_BATCH_MAX)
+		flush_records();
+
+	struct key_event_record *record = &batch[batch_length++];
+	record->time_usec = time_usec;
+	record->device_id = device_id;
+	record->key_code = key_code > UINT16_MAX ? UINT16_MAX : key_code;
+	record->state = state_code != 0;
+	record->reserved = 0;
+}
 
 static int print_key_event(struct libinput_event *event)
 {
 	struct libinput_event_keyboard *keyboard =
 		libinput_event_get_keyboard_event(event);
 
+	if (binary_output) {
+		queue_record(get_device_id(event),
+			     libinput_event_keyboard_get_time_usec(keyboard),
+			     libinput_event_keyboard_get_key(keyboard),
+			     libinput_event_keyboard_get_key_state(keyboard));
+		return 0;
+	}
+
 	enum libinput_event_type event_type = libinput_event_get_type(event);
 	uint32_t time_stamp = libinput_event_keyboard_get_time(keyboard);
+	uint64_t time_usec = libinput_event_keyboard_get_time_usec(keyboard);
 	uint32_t key_code = libinput_event_keyboard_get_key(keyboard);
 	const char *key_name = libevdev_event_code_get_name(EV_KEY, key_code);
 	key_name = key_name ? key_name : "null";
@@ -89,13 +173,16 @@ static int print_key_event(struct libinput_event *event)
 		      "\"event_name\": \"KEYBOARD_KEY\", "
 		      "\"event_type\": %d, "
 		      "\"time_stamp\": %d, "
+		      "\"time_usec\": %llu, "
+		      "\"sent_usec\": %llu, "
 		      "\"key_name\": \"%s\", "
 		      "\"key_code\": %d, "
 		      "\"state_name\": \"%s\", "
 		      "\"state_code\": %d"
 		      "}\n",
-		      event_type, time_stamp, key_name, key_code, state_name,
-		      state_code);
+		      event_type, time_stamp, (unsigned long long)time_usec,
+		      (unsigned long long)monotonic_usec(), key_name, key_code,
+		      state_name, state_code);
 }
 
 static int print_button_event(struct libinput_event *event)
@@ -103,6 +190,14 @@ static int print_button_event(struct libinput_event *event)
 	struct libinput_event_pointer *pointer =
 		libinput_event_get_pointer_event(event);
 
+	if (binary_output) {
+		queue_record(get_device_id(event),
+			     libinput_event_pointer_get_time_usec(pointer),
+			     libinput_event_pointer_get_button(pointer),
+			     libinput_event_pointer_get_button_state(pointer));
+		return 0;
+	}
+
 	enum libinput_event_type event_type = libinput_event_get_type(event);
 	uint32_t time_stamp = libinput_event_pointer_get_time(pointer);
 	uint32_t button_code = libinput_event_pointer_get_button(pointer);
@@ -126,59 +221,139 @@ static int print_button_event(struct libinput_event *event)
 		      state_name, state_code);
 }
 
-static int handle_events(struct libinput *libinput)
+// Kernel timestamp until the event reached us, then the JSON line going
+// out. Binary records are traced as their batch is written.
+static void trace_key(uint64_t start_usec, uint32_t key_code,
+		      uint64_t time_usec)
 {
-	int result = -1;
-	struct libinput_event *event;
+	key_trace_key("input", time_usec, start_usec, key_code, time_usec);
+	if (!binary_output)
+		key_trace_key("write", start_usec, monotonic_usec(), key_code,
+			      time_usec);
+}
 
-	if (libinput_dispatch(libinput) < 0)
-		return result;
+static void handle_event(struct libinput_event *event, void *user_data)
+{
+	(void)user_data;
+	uint64_t start_usec = key_trace_enabled() ? monotonic_usec() : 0;
 
 	// Please keep printing a line per json.
-	while ((event = libinput_get_event(libinput)) != NULL) {
-		switch (libinput_event_get_type(event)) {
-		// This program only handle key event.
-		case LIBINPUT_EVENT_KEYBOARD_KEY:
-			print_key_event(event);
-			break;
-		// Sorry, mouse button is also a key.
-		case LIBINPUT_EVENT_POINTER_BUTTON:
-			print_button_event(event);
-			break;
-		default:
-			break;
-		}
-		// Do a `fflush(stdout)` here, so when we write to pipes,
-		// the other one can always get a latest result.
-		// If we don't have `fflush(stdout)` here, pipe will save
-		// some lines in buffer and pass them together.
+	if (libinput_event_get_type(event) == LIBINPUT_EVENT_KEYBOARD_KEY)
+		print_key_event(event);
+	else
+		print_button_event(event);
+
+	// Do a `fflush(stdout)` here, so when we write to pipes,
+	// the other one can always get a latest result.
+	// If we don't have `fflush(stdout)` here, pipe will save
+	// some lines in buffer and pass them together.
+	if (!binary_output)
 		fflush(stdout);
-		libinput_event_destroy(event);
-		result = 0;
+
+	if (start_usec &&
+	    libinput_event_get_type(event) == LIBINPUT_EVENT_KEYBOARD_KEY) {
+		struct libinput_event_keyboard *keyboard =
+			libinput_event_get_keyboard_event(event);
+		trace_key(start_usec, libinput_event_keyboard_get_key(keyboard),
+			  libinput_event_keyboard_get_time_usec(keyboard));
 	}
+}
+
+static void handle_flush(void *user_data)
+{
+	(void)user_data;
 
-	return result;
+	// Binary records go out in one write per dispatch instead.
+	if (binary_output && batch_length > 0)
+		flush_records();
 }
 
-static int run_mainloop(struct libinput *libinput)
+// Same records and lines as libinput's keyboard events.
+static void handle_evdev_key(const struct key_evdev_event *event,
+			     void *user_data)
 {
-	struct pollfd fd;
-	fd.fd = libinput_get_fd(libinput);
-	fd.events = POLLIN;
-	fd.revents = 0;
-
-	if (handle_events(libinput) != 0) {
-		fprintf(stderr,
-			"Expected device added events on startup but "
-			"got none. Maybe you don't have the right permissions?"
-			"\n");
-		return -1;
+	(void)user_data;
+	uint64_t start_usec = key_trace_enabled() ? monotonic_usec() : 0;
+
+	if (binary_output) {
+		queue_record(event->device_id, event->time_usec,
+			     event->key_code, event->pressed);
+		if (start_usec)
+			trace_key(start_usec, event->key_code, event->time_usec);
+		return;
+	}
+
+	const char *key_name =
+		libevdev_event_code_get_name(EV_KEY, event->key_code);
+	printf("{"
+	       "\"event_name\": \"KEYBOARD_KEY\", "
+	       "\"event_type\": %d, "
+	       "\"time_stamp\": %d, "
+	       "\"time_usec\": %llu, "
+	       "\"sent_usec\": %llu, "
+	       "\"key_name\": \"%s\", "
+	       "\"key_code\": %d, "
+	       "\"state_name\": \"%s\", "
+	       "\"state_code\": %d"
+	       "}\n",
+	       LIBINPUT_EVENT_KEYBOARD_KEY, (uint32_t)(event->time_usec / 1000),
+	       (unsigned long long)event->time_usec,
+	       (unsigned long long)monotonic_usec(),
+	       key_name ? key_name : "null", event->key_code,
+	       event->pressed ? "PRESSED" : "RELEASED", event->pressed);
+	fflush(stdout);
+	if (start_usec)
+		trace_key(start_usec, event->key_code, event->time_usec);
+}
+
+// A comma separated list of key codes and ranges, like 1-88,96.
+static int parse_keys(const char *spec, uint8_t *filter)
+{
+	memset(filter, 0, KEY_FILTER_BYTES);
+	while (*spec) {
+		char *end;
+		long first = strtol(spec, &end, 10);
+		long last = first;
+		if (end == spec)
+			return -1;
+		if (*end == '-') {
+			spec = end + 1;
+			last = strtol(spec, &end, 10);
+			if (end == spec)
+				return -1;
+		}
+		if (first < 0 || last >= KEY_FILTER_CODES || first > last)
+			return -1;
+		for (long code = first; code <= last; code++)
+			KEY_FILTER_SET(filter, code);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		spec = end;
 	}
-	while (poll(&fd, 1, -1) > -1)
-		handle_events(libinput);
 	return 0;
 }
 
+// Skips udev and libinput: only the keyboards are opened, and the kernel
+// only hands us the keys in evdev.filter.
+static int run_evdev(void)
+{
+	evdev.handler = handle_evdev_key;
+	evdev.flush = handle_flush;
+	enum error_code error =
+		key_evdev_open(&evdev, device_paths, num_device_paths);
+	if (error != NO_ERROR)
+		return error;
+
+	pthread_t input_handler;
+	pthread_create(&input_handler, NULL, handle_input, NULL);
+
+	key_evdev_run(&evdev);
+	key_evdev_close(&evdev);
+	return DEVICE_FAILED;
+}
+
 void print_help(char *program_name)
 {
 	printf("The backend of Show Me The Key.\n");
@@ -187,6 +362,14 @@ void print_help(char *program_name)
 	printf("Options:\n");
 	printf("\t-h, --help\tDisplay help then exit.\n");
 	printf("\t-v, --version\tDisplay version then exit.\n");
+	printf("\t-b, --binary\tWrite fixed-size binary records instead of JSON.\n");
+	printf("\t-d, --device PATH\tRead this evdev keyboard instead of every "
+	       "libinput device, \"auto\" for each keyboard in /dev/input. "
+	       "May be repeated.\n");
+	printf("\t-k, --keys LIST\tWith --device, only forward these key codes, "
+	       "like 1-88,96 (default: every key below 256).\n");
+	printf("\t-t, --trace FILE\tAppend a Chrome trace of each key event "
+	       "to FILE.\n");
 	printf("Warning: This is the backend and is not designed to run "
 	       "by users. You should run the frontend of Show Me The Key, "
 	       "and the frontend will run this.\n");
@@ -197,11 +380,21 @@ int main(int argc, char *argv[])
 	const struct option long_options[] = { { "version", no_argument, 0,
 						 'v' },
 					       { "help", no_argument, 0, 'h' },
+					       { "binary", no_argument, 0, 'b' },
+					       { "device", required_argument, 0,
+						 'd' },
+					       { "keys", required_argument, 0,
+						 'k' },
+					       { "trace", required_argument, 0,
+						 't' },
 					       { NULL, 0, NULL, 0 } };
 
+	memset(evdev.filter, 0xff, sizeof(evdev.filter));
+
+	const char *trace_path = NULL;
 	int option_index = 0;
 	int opt = 0;
-	while ((opt = getopt_long(argc, argv, "vh", long_options,
+	while ((opt = getopt_long(argc, argv, "vhbd:k:t:", long_options,
 				  &option_index)) != -1) {
 		switch (opt) {
 		case 0:
@@ -213,6 +406,26 @@ int main(int argc, char *argv[])
 		case 'h':
 			print_help(argv[0]);
 			return 0;
+		case 'b':
+			binary_output = true;
+			break;
+		case 'd':
+			if (num_device_paths == KEY_EVDEV_MAX_DEVICES) {
+				fprintf(stderr, "%s: Too many devices.\n", argv[0]);
+				return DEVICE_FAILED;
+			}
+			device_paths[num_device_paths++] = optarg;
+			break;
+		case 'k':
+			if (parse_keys(optarg, evdev.filter) != 0) {
+				fprintf(stderr, "%s: Invalid key list `%s`.\n",
+					argv[0], optarg);
+				return DEVICE_FAILED;
+			}
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
 		case '?':
 			// getopt_long already printed an error message.
 			break;
@@ -223,40 +436,29 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	struct udev *udev = udev_new();
-	if (udev == NULL) {
-		fprintf(stderr, "Failed to initialize udev.\n");
-		return UDEV_FAILED;
-	}
+	if (trace_path && start_tracing(trace_path) != 0)
+		fprintf(stderr, "%s: Tracing is disabled.\n", argv[0]);
 
-	struct libinput *libinput =
-		libinput_udev_create_context(&interface, NULL, udev);
-	if (!libinput) {
-		fprintf(stderr, "Failed to initialize libinput from udev.\n");
-		return LIBINPUT_FAILED;
-	}
+	if (num_device_paths > 0)
+		return run_evdev();
 
-	// TODO: Support custom seat.
-	if (libinput_udev_assign_seat(libinput, "seat0") != 0) {
-		fprintf(stderr, "Failed to set seat.\n");
-		libinput_unref(libinput);
-		udev_unref(udev);
-		return SEAT_FAILED;
-	}
+	input.handler = handle_event;
+	input.flush = handle_flush;
+	enum error_code error = key_input_open(&input);
+	if (error != NO_ERROR)
+		return error;
 
 	// Typically this will be run with pkexec as a subprocess,
 	// and the parent cannot kill it because it is privileged,
 	// so we use another thread to see if it gets "stop\n" from stdin,
 	// it will exit by itself.
 	pthread_t input_handler;
-	struct input_handler_data input_handler_data = { udev, libinput };
-	pthread_create(&input_handler, NULL, handle_input, &input_handler_data);
+	pthread_create(&input_handler, NULL, handle_input, NULL);
 
-	if (run_mainloop(libinput) < 0)
+	if (key_input_run(&input) < 0)
 		return PERMISSION_FAILED;
 
-	libinput_unref(libinput);
-	udev_unref(udev);
+	key_input_close(&input);
 
 	return NO_ERROR;
 }
@@ -0,0 +1,480 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "key_evdev.h"
+#include "key_trace.h"
+
+#define INPUT_DIR "/dev/input"
+#define LONG_BITS (8 * sizeof(unsigned long))
+// epoll data of the two fds that are not devices
+#define WAKE_INDEX KEY_EVDEV_MAX_DEVICES
+#define HOTPLUG_INDEX (KEY_EVDEV_MAX_DEVICES + 1)
+
+// Only EV_SYN and EV_KEY reach us, and of those only the filtered codes.
+// Kernels before 4.4 lack EVIOCSMASK, read_device filters those itself.
+static void apply_filter(struct key_evdev *input, struct libevdev *device)
+{
+#ifdef EVIOCSMASK
+	// The kernel takes bitmaps of longs.
+	unsigned long types[(EV_CNT + LONG_BITS - 1) / LONG_BITS] = { 0 };
+	unsigned long codes[KEY_FILTER_CODES / LONG_BITS] = { 0 };
+	types[EV_SYN / LONG_BITS] |= 1UL << (EV_SYN % LONG_BITS);
+	types[EV_KEY / LONG_BITS] |= 1UL << (EV_KEY % LONG_BITS);
+	for (unsigned int code = 0; code < KEY_FILTER_CODES; code++) {
+		if (KEY_FILTER_HAS(input->filter, code))
+			codes[code / LONG_BITS] |= 1UL << (code % LONG_BITS);
+	}
+
+	struct input_mask type_mask = { .type = 0, // 0 masks event types
+					.codes_size = sizeof(types),
+					.codes_ptr = (uintptr_t)types };
+	struct input_mask key_mask = { .type = EV_KEY,
+				       .codes_size = sizeof(codes),
+				       .codes_ptr = (uintptr_t)codes };
+	int fd = libevdev_get_fd(device);
+	ioctl(fd, EVIOCSMASK, &type_mask);
+	ioctl(fd, EVIOCSMASK, &key_mask);
+#else
+	(void)input;
+	(void)device;
+#endif
+}
+
+static int is_keyboard(const struct libevdev *device)
+{
+	return libevdev_has_event_type(device, EV_KEY) &&
+	       libevdev_has_event_code(device, EV_KEY, KEY_A) &&
+	       libevdev_has_event_code(device, EV_KEY, KEY_Z) &&
+	       libevdev_has_event_code(device, EV_KEY, KEY_SPACE);
+}
+
+// Whether the node at path is one of the devices already open, or one
+// we found is not a keyboard.
+static int is_known(const struct key_evdev *input, const char *path)
+{
+	struct stat node, open_node;
+	if (stat(path, &node) != 0)
+		return 0;
+
+	for (int i = 0; i < KEY_EVDEV_MAX_IGNORED; i++) {
+		if (input->ignored[i].rdev == node.st_rdev)
+			return 1;
+	}
+	for (int i = 0; i < input->num_devices; i++) {
+		if (input->devices[i] &&
+		    fstat(libevdev_get_fd(input->devices[i]), &open_node) == 0 &&
+		    open_node.st_rdev == node.st_rdev)
+			return 1;
+	}
+	return 0;
+}
+
+// Remember that the node open as fd is not a keyboard. Once every slot is
+// taken, further ones are just looked at again on each event.
+static void ignore_node(struct key_evdev *input, int fd, const char *path)
+{
+	struct stat node;
+	const char *name = strrchr(path, '/');
+	if (fstat(fd, &node) != 0 || node.st_rdev == 0 || !name ||
+	    strncmp(name + 1, "event", 5) != 0)
+		return;
+
+	for (int i = 0; i < KEY_EVDEV_MAX_IGNORED; i++) {
+		if (input->ignored[i].rdev == 0) {
+			input->ignored[i].rdev = node.st_rdev;
+			input->ignored[i].number = atoi(name + 6);
+			return;
+		}
+	}
+}
+
+// The node eventN is gone, whatever is created under that name next gets
+// looked at again.
+static void forget_node(struct key_evdev *input, const char *name)
+{
+	int number = atoi(name + 5);
+	for (int i = 0; i < KEY_EVDEV_MAX_IGNORED; i++) {
+		if (input->ignored[i].rdev && input->ignored[i].number == number)
+			input->ignored[i].rdev = 0;
+	}
+}
+
+// Returns 0 when the device was added, 1 when it is not a keyboard and
+// only_keyboards is set, -1 on errors with errno from opening it. The
+// device takes the first free slot, those of unplugged ones are reused.
+// With quiet, being denied access to the node is not reported.
+static int add_device(struct key_evdev *input, const char *path,
+		      int only_keyboards, int quiet)
+{
+	int index = 0;
+	while (index < input->num_devices && input->devices[index])
+		index++;
+	if (index == KEY_EVDEV_MAX_DEVICES) {
+		fprintf(stderr, "Too many input devices, ignoring %s.\n", path);
+		return 1;
+	}
+
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		int error = errno;
+		if (!quiet || (error != EACCES && error != EPERM))
+			fprintf(stderr, "Failed to open %s because of %s.\n",
+				path, strerror(error));
+		errno = error;
+		return -1;
+	}
+
+	struct libevdev *device;
+	int error = libevdev_new_from_fd(fd, &device);
+	if (error < 0) {
+		fprintf(stderr, "Failed to read %s because of %s.\n", path,
+			strerror(-error));
+		close(fd);
+		return -1;
+	}
+
+	if (!is_keyboard(device)) {
+		if (only_keyboards)
+			ignore_node(input, fd, path);
+		else
+			fprintf(stderr, "%s is not a keyboard.\n", path);
+		libevdev_free(device);
+		close(fd);
+		return only_keyboards ? 1 : -1;
+	}
+
+	// libinput timestamps are monotonic, and so are the player's clocks.
+	libevdev_set_clock_id(device, CLOCK_MONOTONIC);
+	apply_filter(input, device);
+
+	struct epoll_event event = { .events = EPOLLIN, .data.u32 = index };
+	if (epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		fprintf(stderr, "Failed to watch %s because of %s.\n", path,
+			strerror(errno));
+		libevdev_free(device);
+		close(fd);
+		return -1;
+	}
+
+	input->devices[index] = device;
+	if (index == input->num_devices)
+		input->num_devices++;
+	fprintf(stderr, "Reading keys from %s (%s).\n", path,
+		libevdev_get_name(device));
+	return 0;
+}
+
+static int is_event_node(const struct dirent *entry)
+{
+	return strncmp(entry->d_name, "event", 5) == 0;
+}
+
+// In eventN order, so device ids stay the same between runs.
+static int compare_event_nodes(const struct dirent **a, const struct dirent **b)
+{
+	return atoi((*a)->d_name + 5) - atoi((*b)->d_name + 5);
+}
+
+// Add every keyboard in INPUT_DIR that is not open yet. Returns how many
+// were added, and counts the nodes we may not open in denied. Without
+// denied, those are skipped quietly.
+static int add_keyboards(struct key_evdev *input, int *denied)
+{
+	struct dirent **entries;
+	int count = scandir(INPUT_DIR, &entries, is_event_node,
+			    compare_event_nodes);
+	if (count < 0) {
+		fprintf(stderr, "Failed to list " INPUT_DIR " because of %s.\n",
+			strerror(errno));
+		return 0;
+	}
+
+	int added = 0;
+	for (int i = 0; i < count; i++) {
+		char path[sizeof(INPUT_DIR) + 256];
+		snprintf(path, sizeof(path), INPUT_DIR "/%s",
+			 entries[i]->d_name);
+		free(entries[i]);
+		if (is_known(input, path))
+			continue;
+
+		int result = add_device(input, path, 1, !denied);
+		if (result == 0)
+			added++;
+		else if (result < 0 && denied &&
+			 (errno == EACCES || errno == EPERM))
+			(*denied)++;
+	}
+	free(entries);
+	return added;
+}
+
+// With "auto", nodes created later are keyboards plugged in, or coming
+// back after a suspend. udev sets their permissions after creating them,
+// so a change of attributes is another chance to open one. Until then we
+// may not open it, which is not worth a message each time.
+static int watch_keyboards(struct key_evdev *input)
+{
+	input->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	struct epoll_event event = { .events = EPOLLIN,
+				     .data.u32 = HOTPLUG_INDEX };
+	if (input->inotify_fd < 0 ||
+	    inotify_add_watch(input->inotify_fd, INPUT_DIR,
+			      IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+	    epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD, input->inotify_fd,
+		      &event) != 0) {
+		fprintf(stderr, "Failed to watch " INPUT_DIR " because of %s.\n",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Returns how many keyboards were added.
+static int add_plugged_keyboards(struct key_evdev *input)
+{
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	int added = 0;
+	ssize_t length;
+
+	while ((length = read(input->inotify_fd, buffer, sizeof(buffer))) > 0) {
+		for (char *next = buffer; next < buffer + length;
+		     next += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)next;
+			// Events were lost, look at everything again.
+			if (event->mask & IN_Q_OVERFLOW) {
+				memset(input->ignored, 0,
+				       sizeof(input->ignored));
+				added += add_keyboards(input, NULL);
+				continue;
+			}
+			if (event->len == 0 ||
+			    strncmp(event->name, "event", 5) != 0)
+				continue;
+
+			if (event->mask & IN_DELETE) {
+				forget_node(input, event->name);
+				continue;
+			}
+
+			char path[sizeof(INPUT_DIR) + 256];
+			snprintf(path, sizeof(path), INPUT_DIR "/%s",
+				 event->name);
+			if (!is_known(input, path) &&
+			    add_device(input, path, 1, 1) == 0)
+				added++;
+		}
+	}
+	return added;
+}
+
+enum error_code key_evdev_open(struct key_evdev *input, char *const *paths,
+			       int num_paths)
+{
+	input->num_devices = 0;
+	input->filter_pending = 0;
+	input->inotify_fd = -1;
+	memset(input->ignored, 0, sizeof(input->ignored));
+	input->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	input->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event wake = { .events = EPOLLIN,
+				    .data.u32 = WAKE_INDEX };
+	if (input->epoll_fd < 0 || input->wake_fd < 0 ||
+	    epoll_ctl(input->epoll_fd, EPOLL_CTL_ADD, input->wake_fd, &wake) != 0) {
+		fprintf(stderr, "Failed to set up epoll because of %s.\n",
+			strerror(errno));
+		key_evdev_close(input);
+		return DEVICE_FAILED;
+	}
+
+	// Watch before scanning, so no keyboard slips in between.
+	int denied = 0;
+	for (int i = 0; i < num_paths; i++) {
+		if (strcmp(paths[i], "auto") == 0) {
+			if (input->inotify_fd < 0 && watch_keyboards(input) != 0) {
+				key_evdev_close(input);
+				return DEVICE_FAILED;
+			}
+			add_keyboards(input, &denied);
+		} else if (add_device(input, paths[i], 0, 0) != 0) {
+			key_evdev_close(input);
+			return DEVICE_FAILED;
+		}
+	}
+
+	if (input->num_devices > 0)
+		return NO_ERROR;
+	if (denied > 0) {
+		fprintf(stderr, "No keyboard found in " INPUT_DIR ". "
+				"Maybe you don't have the right permissions?\n");
+		key_evdev_close(input);
+		return PERMISSION_FAILED;
+	}
+	fprintf(stderr, "No keyboard in " INPUT_DIR " yet, waiting for one.\n");
+	return NO_ERROR;
+}
+
+void key_evdev_close(struct key_evdev *input)
+{
+	for (int i = 0; i < input->num_devices; i++) {
+		if (input->devices[i]) {
+			int fd = libevdev_get_fd(input->devices[i]);
+			libevdev_free(input->devices[i]);
+			close(fd);
+			input->devices[i] = NULL;
+		}
+	}
+	input->num_devices = 0;
+	if (input->epoll_fd >= 0)
+		close(input->epoll_fd);
+	if (input->wake_fd >= 0)
+		close(input->wake_fd);
+	if (input->inotify_fd >= 0)
+		close(input->inotify_fd);
+	input->epoll_fd = -1;
+	input->wake_fd = -1;
+	input->inotify_fd = -1;
+}
+
+void key_evdev_set_filter(struct key_evdev *input, const uint8_t *filter)
+{
+	for (int i = 0; i < KEY_FILTER_BYTES; i++)
+		__atomic_store_n(&input->pending_filter[i], filter[i],
+				 __ATOMIC_RELAXED);
+	__atomic_store_n(&input->filter_pending, 1, __ATOMIC_RELEASE);
+
+	uint64_t one = 1;
+	ssize_t written = write(input->wake_fd, &one, sizeof(one));
+	(void)written;
+}
+
+static void take_pending_filter(struct key_evdev *input)
+{
+	uint64_t count;
+	ssize_t got = read(input->wake_fd, &count, sizeof(count));
+	(void)got;
+	if (!__atomic_exchange_n(&input->filter_pending, 0, __ATOMIC_ACQUIRE))
+		return;
+
+	for (int i = 0; i < KEY_FILTER_BYTES; i++)
+		input->filter[i] = __atomic_load_n(&input->pending_filter[i],
+						   __ATOMIC_RELAXED);
+	for (int i = 0; i < input->num_devices; i++) {
+		if (input->devices[i])
+			apply_filter(input, input->devices[i]);
+	}
+}
+
+// Returns -1 once the device is gone.
+static int read_device(struct key_evdev *input, int index)
+{
+	struct libevdev *device = input->devices[index];
+	unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+	struct input_event event;
+	int status;
+
+	while ((status = libevdev_next_event(device, flags, &event)) >= 0) {
+		if (status == LIBEVDEV_READ_STATUS_SYNC) {
+			// Events were dropped, catch up on state without
+			// sounding keys that changed while we were not looking.
+			flags = LIBEVDEV_READ_FLAG_SYNC;
+			continue;
+		}
+		// Value 2 is autorepeat, libinput drops it too.
+		if (event.type != EV_KEY || event.value > 1 ||
+		    !KEY_FILTER_HAS(input->filter, event.code))
+			continue;
+
+		struct key_evdev_event key = {
+			.time_usec = (uint64_t)event.input_event_sec * 1000000 +
+				     event.input_event_usec,
+			.device_id = index + 1,
+			.key_code = event.code,
+			.pressed = event.value
+		};
+		input->handler(&key, input->user_data);
+	}
+
+	// -EAGAIN ends both a normal read and a finished sync.
+	return status == -EAGAIN ? 0 : -1;
+}
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int key_evdev_run(struct key_evdev *input)
+{
+	struct epoll_event ready[KEY_EVDEV_MAX_DEVICES + 2];
+	int open_devices = input->num_devices;
+
+	// Watching for new keyboards, losing the last one is not the end.
+	while (open_devices > 0 || input->inotify_fd >= 0) {
+		int count = epoll_wait(input->epoll_fd, ready,
+				       KEY_EVDEV_MAX_DEVICES + 2, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (int i = 0; i < count; i++) {
+			uint32_t index = ready[i].data.u32;
+			if (index == WAKE_INDEX) {
+				take_pending_filter(input);
+				continue;
+			}
+			if (index == HOTPLUG_INDEX) {
+				open_devices += add_plugged_keyboards(input);
+				continue;
+			}
+			if (!input->devices[index])
+				continue;
+			uint64_t start_usec =
+				key_trace_enabled() ? monotonic_usec() : 0;
+			int result = read_device(input, index);
+			if (start_usec)
+				key_trace_span("evdev_read", start_usec,
+					       monotonic_usec());
+			if (result == 0)
+				continue;
+
+			// Unplugged, the others carry on.
+			struct libevdev *device = input->devices[index];
+			int fd = libevdev_get_fd(device);
+			fprintf(stderr, "Lost %s.\n", libevdev_get_name(device));
+			epoll_ctl(input->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			libevdev_free(device);
+			close(fd);
+			input->devices[index] = NULL;
+			if (--open_devices == 0 && input->inotify_fd >= 0)
+				fprintf(stderr, "Waiting for a keyboard to be "
+						"plugged in.\n");
+		}
+
+		if (input->flush)
+			input->flush(input->user_data);
+	}
+
+	fprintf(stderr, "Every keyboard is gone.\n");
+	return -1;
+}
@@ -0,0 +1,68 @@
+#ifndef __KEY_EVDEV_H__
+#define __KEY_EVDEV_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libevdev/libevdev.h>
+
+#include "key_input.h"
+
+#define KEY_EVDEV_MAX_DEVICES 32
+#define KEY_EVDEV_MAX_IGNORED 64
+// Codes a pack can map to a sound, BTN_MISC and up are mouse and pad buttons.
+#define KEY_FILTER_CODES 256
+#define KEY_FILTER_BYTES (KEY_FILTER_CODES / 8)
+
+#define KEY_FILTER_SET(filter, code) \
+	((filter)[(code) / 8] |= (uint8_t)(1 << ((code) % 8)))
+#define KEY_FILTER_HAS(filter, code) \
+	((code) < KEY_FILTER_CODES && ((filter)[(code) / 8] >> ((code) % 8)) & 1)
+
+struct key_evdev_event {
+	uint64_t time_usec; // CLOCK_MONOTONIC, like libinput's timestamps
+	uint32_t device_id; // slot of the device, from 1, reused once it is gone
+	uint32_t key_code;
+	int pressed;
+};
+
+// Called for every key press and release that passes the filter.
+typedef void (*key_evdev_handler)(const struct key_evdev_event *event,
+				  void *user_data);
+
+// Reads keyboards straight from their evdev nodes, without udev or
+// libinput. Autorepeat and every other event type are dropped, and the
+// kernel only delivers key codes in the filter. With "auto", keyboards
+// plugged in later are picked up through inotify on /dev/input.
+struct key_evdev {
+	struct libevdev *devices[KEY_EVDEV_MAX_DEVICES];
+	int num_devices;
+	int epoll_fd;
+	int wake_fd; // eventfd, a new filter is waiting to be applied
+	int inotify_fd; // watches /dev/input for "auto", -1 otherwise
+	// Nodes that are not keyboards, skipped until they are created again.
+	// A slot with rdev 0 is free.
+	struct {
+		dev_t rdev;
+		int number; // N of eventN
+	} ignored[KEY_EVDEV_MAX_IGNORED];
+	uint8_t filter[KEY_FILTER_BYTES];
+	uint8_t pending_filter[KEY_FILTER_BYTES];
+	int filter_pending;
+	key_evdev_handler handler;
+	key_input_flush flush;
+	void *user_data;
+};
+
+// Open each path, or every keyboard in /dev/input for "auto", which may
+// find none yet. handler, flush and filter must already be set.
+enum error_code key_evdev_open(struct key_evdev *input, char *const *paths,
+			       int num_paths);
+void key_evdev_close(struct key_evdev *input);
+// Read keys forever, only returns on failure or once every device given
+// by path is gone. "auto" waits for keyboards to come back instead.
+int key_evdev_run(struct key_evdev *input);
+// Replace the filter while key_evdev_run is reading, from any thread.
+void key_evdev_set_filter(struct key_evdev *input, const uint8_t *filter);
+
+#endif
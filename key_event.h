@@ -0,0 +1,24 @@
+#ifndef __KEY_EVENT_H__
+#define __KEY_EVENT_H__
+
+#include <stdint.h>
+
+// Binary record passed from get_key_presses to keyboard_sound_player
+// when both are started with --binary. JSON lines remain the default
+// since they are easy to read when debugging.
+//
+// Records are fixed size and written in batches no larger than PIPE_BUF,
+// so a reader never sees a record split across two writes.
+struct key_event_record {
+	uint64_t time_usec; // libinput timestamp, CLOCK_MONOTONIC
+	uint64_t sent_usec; // CLOCK_MONOTONIC when the batch was written
+	uint32_t device_id; // small per-run id, assigned in order of first event
+	uint16_t key_code;
+	uint8_t state; // 1 pressed, 0 released
+	uint8_t reserved;
+};
+
+#define KEY_EVENT_RECORD_SIZE sizeof(struct key_event_record)
+#define KEY_EVENT_BATCH_MAX (4096 / KEY_EVENT_RECORD_SIZE)
+
+#endif
@@ -0,0 +1,125 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "key_input.h"
+#include "key_trace.h"
+
+static int open_restricted(const char *path, int flags, void *user_data)
+{
+    (void)user_data;
+	int fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "Failed to open %s because of %s.\n", path,
+			strerror(errno));
+	return fd < 0 ? -errno : fd;
+}
+
+static void close_restricted(int fd, void *user_data)
+{
+    (void)user_data;
+	close(fd);
+}
+
+static const struct libinput_interface interface = {
+	.open_restricted = open_restricted,
+	.close_restricted = close_restricted,
+};
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int handle_events(struct key_input *input)
+{
+	int result = -1;
+	struct libinput_event *event;
+
+	uint64_t start_usec = key_trace_enabled() ? monotonic_usec() : 0;
+	if (libinput_dispatch(input->libinput) < 0)
+		return result;
+	if (start_usec)
+		key_trace_span("libinput_dispatch", start_usec, monotonic_usec());
+
+	while ((event = libinput_get_event(input->libinput)) != NULL) {
+		switch (libinput_event_get_type(event)) {
+		// This program only handle key event.
+		case LIBINPUT_EVENT_KEYBOARD_KEY:
+		// Sorry, mouse button is also a key.
+		case LIBINPUT_EVENT_POINTER_BUTTON:
+			input->handler(event, input->user_data);
+			break;
+		default:
+			break;
+		}
+		libinput_event_destroy(event);
+		result = 0;
+	}
+
+	if (input->flush)
+		input->flush(input->user_data);
+
+	return result;
+}
+
+int key_input_run(struct key_input *input)
+{
+	struct pollfd fd;
+	fd.fd = libinput_get_fd(input->libinput);
+	fd.events = POLLIN;
+	fd.revents = 0;
+
+	if (handle_events(input) != 0) {
+		fprintf(stderr,
+			"Expected device added events on startup but "
+			"got none. Maybe you don't have the right permissions?"
+			"\n");
+		return -1;
+	}
+	while (poll(&fd, 1, -1) > -1)
+		handle_events(input);
+	return 0;
+}
+
+enum error_code key_input_open(struct key_input *input)
+{
+	input->udev = udev_new();
+	if (input->udev == NULL) {
+		fprintf(stderr, "Failed to initialize udev.\n");
+		return UDEV_FAILED;
+	}
+
+	input->libinput =
+		libinput_udev_create_context(&interface, NULL, input->udev);
+	if (!input->libinput) {
+		fprintf(stderr, "Failed to initialize libinput from udev.\n");
+		udev_unref(input->udev);
+		return LIBINPUT_FAILED;
+	}
+
+	// TODO: Support custom seat.
+	if (libinput_udev_assign_seat(input->libinput, "seat0") != 0) {
+		fprintf(stderr, "Failed to set seat.\n");
+		libinput_unref(input->libinput);
+		udev_unref(input->udev);
+		return SEAT_FAILED;
+	}
+
+	return NO_ERROR;
+}
+
+void key_input_close(struct key_input *input)
+{
+	libinput_unref(input->libinput);
+	udev_unref(input->udev);
+}
@@ -0,0 +1,37 @@
+#ifndef __KEY_INPUT_H__
+#define __KEY_INPUT_H__
+
+#include <libudev.h>
+#include <libinput.h>
+
+enum error_code {
+	NO_ERROR,
+	UDEV_FAILED,
+	LIBINPUT_FAILED,
+	SEAT_FAILED,
+	PERMISSION_FAILED,
+	DEVICE_FAILED
+};
+
+// Called for every key and pointer button event, before it is destroyed.
+typedef void (*key_input_handler)(struct libinput_event *event,
+				  void *user_data);
+// Called once after each libinput_dispatch round, may be NULL.
+typedef void (*key_input_flush)(void *user_data);
+
+struct key_input {
+	struct udev *udev;
+	struct libinput *libinput;
+	key_input_handler handler;
+	key_input_flush flush;
+	void *user_data;
+};
+
+// Create the udev/libinput context on seat0, handler and flush must
+// already be set.
+enum error_code key_input_open(struct key_input *input);
+void key_input_close(struct key_input *input);
+// Poll libinput forever, only returns on failure.
+int key_input_run(struct key_input *input);
+
+#endif
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "key_trace.h"
+
+#define WRITE_BUFFER_BYTES (64 * 1024)
+#define MAX_LINE_BYTES 512
+
+struct span {
+	const char *name;
+	uint64_t start_usec;
+	uint64_t end_usec;
+	uint64_t event_usec; // key event, 0 for work on the thread
+	uint32_t key_code;
+};
+
+// Written only by its thread at head, read only by the writer at tail.
+struct ring {
+	struct span spans[KEY_TRACE_RING_SPANS];
+	unsigned head __attribute__((aligned(64)));
+	unsigned tail __attribute__((aligned(64)));
+	unsigned long dropped; // spans lost because the ring was full
+	const char *thread_name;
+	int named; // thread_name has been written
+	int retired; // its thread exited, head no longer moves
+	pid_t tid;
+	struct ring *next;
+};
+
+static int enabled = 0;
+static int trace_fd = -1;
+static pid_t trace_pid;
+static struct ring *rings = NULL; // every thread's, pushed without locks
+static __thread struct ring *thread_ring = NULL;
+static pthread_key_t ring_key; // retires the ring when its thread exits
+static unsigned long retired_dropped = 0; // of freed rings, under drain_lock
+
+static pthread_t writer_thread;
+static sem_t writer_wakeup;
+static int writer_quit = 0;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char out[WRITE_BUFFER_BYTES];
+static size_t out_length = 0;
+
+static void write_out(void)
+{
+	const char *data = out;
+	while (out_length > 0) {
+		ssize_t written = write(trace_fd, data, out_length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data += written;
+		out_length -= written;
+	}
+	out_length = 0;
+}
+
+// One JSON object per line, each ending in a comma. Chrome and Perfetto
+// accept an array without its closing bracket, which lets several
+// processes append to one file.
+static void emit(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *format, ...)
+{
+	if (out_length + MAX_LINE_BYTES > sizeof(out))
+		write_out();
+
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(out + out_length, MAX_LINE_BYTES, format, args);
+	va_end(args);
+	if (length > 0)
+		out_length += length < MAX_LINE_BYTES ? length : MAX_LINE_BYTES - 1;
+}
+
+static void emit_span(const struct ring *ring, const struct span *span)
+{
+	unsigned long long start = span->start_usec;
+	unsigned long long end = span->end_usec;
+
+	if (span->event_usec == 0) {
+		emit("{\"name\":\"%s\",\"cat\":\"mechsim\",\"ph\":\"X\","
+		     "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d},\n",
+		     span->name, start, end - start, (int)trace_pid,
+		     (int)ring->tid);
+		return;
+	}
+
+	// Nested async spans, global ids join up those of other processes.
+	for (int phase = 0; phase < 2; phase++) {
+		emit("{\"name\":\"%s\",\"cat\":\"key\",\"ph\":\"%c\","
+		     "\"id2\":{\"global\":\"%llx\"},\"ts\":%llu,"
+		     "\"pid\":%d,\"tid\":%d,\"args\":{\"key\":%u}},\n",
+		     span->name, phase == 0 ? 'b' : 'e',
+		     (unsigned long long)span->event_usec,
+		     phase == 0 ? start : end, (int)trace_pid, (int)ring->tid,
+		     span->key_code);
+	}
+}
+
+// Called by one thread at a time, under drain_lock.
+static void drain_ring(struct ring *ring)
+{
+	if (!ring->named && ring->thread_name) {
+		emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		     "\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+		     (int)trace_pid, (int)ring->tid, ring->thread_name);
+		ring->named = 1;
+	}
+
+	unsigned tail = ring->tail;
+	unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++)
+		emit_span(ring, &ring->spans[tail & (KEY_TRACE_RING_SPANS - 1)]);
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Threads only ever push at the head, so a ring further down is unlinked
+// from its predecessor and the head needs a compare and swap. Under
+// drain_lock, nothing else removes rings.
+static void unlink_ring(struct ring *ring)
+{
+	struct ring *head = ring;
+	if (__atomic_compare_exchange_n(&rings, &head, ring->next, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+
+	struct ring *prev = head;
+	while (prev->next != ring)
+		prev = prev->next;
+	prev->next = ring->next;
+}
+
+static void drain_all(void)
+{
+	pthread_mutex_lock(&drain_lock);
+	struct ring *next;
+	for (struct ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	     ring; ring = next) {
+		next = ring->next;
+		// Read before draining, so every span before it is written.
+		int retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+		drain_ring(ring);
+		if (retired) {
+			retired_dropped += ring->dropped;
+			unlink_ring(ring);
+			free(ring);
+		}
+	}
+	write_out();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+static void *writer_main(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&writer_quit, __ATOMIC_RELAXED)) {
+		while (sem_wait(&writer_wakeup) != 0 && errno == EINTR) {
+		}
+		drain_all();
+	}
+	return NULL;
+}
+
+// Thread exit, for the writer to free the ring. A later span on this
+// thread, from another destructor, gets a new ring.
+static void retire_ring(void *ring)
+{
+	thread_ring = NULL;
+	__atomic_store_n(&((struct ring *)ring)->retired, 1, __ATOMIC_RELEASE);
+	sem_post(&writer_wakeup);
+}
+
+static struct ring *get_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	struct ring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->tid = (pid_t)syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+static void record(const char *name, uint64_t start_usec, uint64_t end_usec,
+		   uint32_t key_code, uint64_t event_usec)
+{
+	// Unknown start times are 0, like in the player's stats.
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED) || start_usec == 0 ||
+	    end_usec < start_usec)
+		return;
+
+	struct ring *ring = get_ring();
+	if (!ring)
+		return;
+
+	unsigned head = ring->head;
+	unsigned used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (used >= KEY_TRACE_RING_SPANS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct span *span = &ring->spans[head & (KEY_TRACE_RING_SPANS - 1)];
+	span->name = name;
+	span->start_usec = start_usec;
+	span->end_usec = end_usec;
+	span->event_usec = event_usec;
+	span->key_code = key_code;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	// sem_post neither blocks nor allocates, the mixer can call it.
+	if (used + 1 == KEY_TRACE_RING_SPANS / 2)
+		sem_post(&writer_wakeup);
+}
+
+int key_trace_enabled(void)
+{
+	return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void key_trace_span(const char *name, uint64_t start_usec, uint64_t end_usec)
+{
+	record(name, start_usec, end_usec, 0, 0);
+}
+
+void key_trace_key(const char *name, uint64_t start_usec, uint64_t end_usec,
+		   uint32_t key_code, uint64_t event_usec)
+{
+	// Without a timestamp there is nothing to join the stages by.
+	if (event_usec == 0) {
+		record(name, start_usec, end_usec, 0, 0);
+		return;
+	}
+	record(name, start_usec, end_usec, key_code, event_usec);
+}
+
+void key_trace_thread(const char *name)
+{
+	if (!key_trace_enabled())
+		return;
+
+	struct ring *ring = get_ring();
+	if (ring)
+		ring->thread_name = name;
+}
+
+int key_trace_open(const char *path, const char *process_name)
+{
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (trace_fd < 0) {
+		fprintf(stderr, "Failed to open trace file %s because of %s.\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	// Whoever finds the file empty starts the array.
+	struct stat st;
+	if (fstat(trace_fd, &st) == 0 && st.st_size == 0)
+		emit("[\n");
+
+	trace_pid = getpid();
+	emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	     "\"args\":{\"name\":\"%s\"}},\n",
+	     (int)trace_pid, process_name);
+	write_out();
+
+	// Signals are left to the threads that expect them.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int error = sem_init(&writer_wakeup, 0, 0) != 0 ||
+		    pthread_key_create(&ring_key, retire_ring) != 0 ||
+		    pthread_create(&writer_thread, NULL, writer_main, NULL) != 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error) {
+		fprintf(stderr, "Failed to start the trace writer.\n");
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+	atexit(key_trace_close);
+	return 0;
+}
+
+void key_trace_close(void)
+{
+	if (!__atomic_exchange_n(&enabled, 0, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&writer_quit, 1, __ATOMIC_RELAXED);
+	sem_post(&writer_wakeup);
+	pthread_join(writer_thread, NULL);
+	drain_all();
+
+	unsigned long dropped = retired_dropped;
+	for (struct ring *ring = rings; ring; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped > 0)
+		fprintf(stderr, "Trace: dropped %lu spans, the writer fell behind.\n",
+			dropped);
+
+	close(trace_fd);
+	trace_fd = -1;
+}
@@ -0,0 +1,39 @@
+#ifndef __KEY_TRACE_H__
+#define __KEY_TRACE_H__
+
+#include <stdint.h>
+
+// Opt-in tracing of the keystroke pipeline, written as Chrome trace event
+// JSON that chrome://tracing and ui.perfetto.dev open.
+//
+// Each thread records spans into its own ring without locks, and only
+// allocates the ring on its first span or key_trace_thread. A writer
+// thread turns them into JSON once a ring is half full, and
+// key_trace_close writes out the rest. The ring of a thread that exits is
+// freed once the writer has drained it.
+//
+// The file is appended to, so get_key_presses and the player can trace
+// into the same one. Times are CLOCK_MONOTONIC like libinput's, so the
+// processes line up on one timeline.
+
+#define KEY_TRACE_RING_SPANS 8192 // per thread, must be a power of two
+
+// Start tracing this process into path. Returns 0, or -1 when the file
+// cannot be opened. Everything else is a no-op until this succeeds.
+int key_trace_open(const char *path, const char *process_name);
+// Stop the writer and flush every thread's spans. Also run at exit.
+void key_trace_close(void);
+// Name the calling thread in the trace and set up its ring now, for
+// threads that must not allocate later.
+void key_trace_thread(const char *name);
+// Work done on this thread. name must outlive the trace, a literal.
+void key_trace_span(const char *name, uint64_t start_usec, uint64_t end_usec);
+// A stage of one keystroke. Stages of the same key event, identified by
+// its libinput timestamp event_usec, are drawn together on one track
+// whichever thread or process recorded them.
+void key_trace_key(const char *name, uint64_t start_usec, uint64_t end_usec,
+		   uint32_t key_code, uint64_t event_usec);
+// Whether key_trace_open succeeded, to skip clock reads when not tracing.
+int key_trace_enabled(void);
+
+#endif
@@ -2,23 +2,121 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <json-c/json.h>
-#include <pulse/simple.h>
+#include <pulse/pulseaudio.h>
 #include <sndfile.h>
-#include <pulse/error.h>
+#include <alsa/asoundlib.h>
 #include <libgen.h> // For dirname
+#include <getopt.h>
+#include "key_event.h"
+#include "key_trace.h"
+#ifdef MECHSIM_INPROCESS
+#include "key_input.h"
+#include "key_evdev.h"
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_LINE_LENGTH 1024
-#define MAX_CONCURRENT_SOUNDS 10
+#define MAX_CONCURRENT_SOUNDS 10  // default voice pool size
+#define MAX_VOICE_POOL 256
+#define STEAL_FADE_VOICES 4       // spare slots for stolen voices fading out
+#define STEAL_FADE_MS 5
+#define RELEASE_FADE_MS 10        // press tail cut short by its key's release
+#define KEY_VOICE_CAP 2           // default voices per key for the "cap" policy
+#define THROTTLE_BURST_MS 100     // events allowed at once, at the --max-event-rate rate
+#define MAX_OUTPUT_CHANNELS 2
+#define MIX_PERIOD_FRAMES 256     // frames mixed per output write
+#define ENGINE_RATE 48000         // default mixer rate, every sample is converted to it
+#define RESAMPLE_TABLE_RES 512
+#define RESAMPLE_MAX_ZERO_CROSSINGS 64
+#define OUTPUT_LATENCY_MS 20      // default target output buffer, see --latency-ms
+#define SCHEDULE_DELAY_MS 10      // default key event to sound start, see --schedule-ms
+#define CLOCK_RESYNC_MS 100       // mixer clock error that is a stall, not jitter
+#define IDLE_TIMEOUT_MS 1000      // default silence before the output is stopped, see --idle-ms
+#define EVENT_QUEUE_SIZE 256      // must be a power of two
+#define PACK_CACHE_MAGIC "MECHPAK\0"
+#define PACK_CACHE_VERSION 5
+#define MAX_PACK_SOURCES 518      // generic presses, release, press and release per key
+#define MAX_DECODE_WORKERS 8
+#define RELOAD_SETTLE_MS 100       // quiet time after a config change before reloading
+#define VOLUME_RAMP_MS 50         // time for a full scale volume change
+#define VOLUME_RAMP_FRAMES 16     // the gain steps this often while ramping
+#define KEY_SPACE 57              // linux/input-event-codes.h
+#define KEY_ENTER 28
+#define MIXER_STACK_PREFAULT (64 * 1024)
+#define RENDER_RANDOM_SEED 2463534242u   // --render picks generic presses the same way every run
+#define LATENCY_BUCKETS 304       // 16 linear, then 8 per power of two up to ~36 min
 
 typedef struct {
     int start_ms;
     int duration_ms;
 } SoundMapping;
 
+// One decoded sound: a whole file in multi mode, a key's segment of the
+// sound file in single mode. Written by a decode worker, the mixer only
+// looks at it once ready is set. With a memory budget it can be evicted
+// again, see source_acquire.
 typedef struct {
+    char *path;        // NULL when mapped from a pack cache
+    int start_ms;      // segment of the file, duration_ms 0 for all of it
+    int duration_ms;
+    short *data;       // interleaved S16 at the engine rate
+    size_t frames;     // 0 when decoding failed or the segment is empty
+    int channels;
+    int source_rate;   // of the file it was decoded from
+    int owned;         // data was malloc'd rather than mapped
+    int ready;         // set last, with release ordering
+    int playing;       // voices holding it, it is not evicted while set
+    int requested;     // waiting for the residency thread to decode it
+    int pinned;        // fallback sounds stay resident whatever the budget
+    uint64_t last_used;
+    int64_t file_mtime_ns;   // of path when it was decoded, for the pack cache
+    int64_t file_size;
+} SampleSource;
+
+// Decoded PCM for every sample in the pack
+typedef struct {
+    SampleSource *sources;   // allocated once, never moves while workers run
+    int num_sources;
+    int channels;      // engine layout, sources are this or mono
+    int samplerate;    // engine rate, every source is converted to it
+    void *mapping;     // set when sources point into a mapped pack cache
+    size_t mapping_size;
+} SampleStore;
+
+// A pack's residency thread, with a memory budget. Each pack has its own,
+// so the one playing keeps decoding while a reloaded pack starts up.
+typedef struct {
+    pthread_t thread;
+    sem_t wakeup;
+    int running;       // thread and wakeup exist, set last with release ordering
+    int stop;
+    int prefetched;
+    size_t bytes;      // of the resident_bytes total decoded for this pack
+} Residency;
+
+typedef struct SoundPack {
+    char name[128];          // display name from the config, may be empty
     char press_file[256];     // used in multi mode
     char release_file[256];  // used in multi mode
     char generic_press_files[5][256];   // max 5 files GENERIC_R0..R4
@@ -30,28 +128,325 @@ typedef struct {
     struct {
         char *press;
         char *release;
+        SampleSource *press_source;
+        SampleSource *release_source;
     } multi_key_mappings[256];
 
+    SampleSource *generic_press_sources[5];
+    SampleSource *release_source;
+    SampleSource *key_sources[256];  // single mode segments of sound_file
+
     int is_multi;
-    SF_INFO sf_info;
+    SampleStore store;
+    Residency residency;
+
+    // Worked out before the config is read, so a pack decoded from an old
+    // config is never cached under a newer one's key
+    char real_config[PATH_MAX];
+    char cache_file[PATH_MAX + 64];   // empty without a cache directory
 } SoundPack;
 
+// A source as stored in a pack cache file
+typedef struct {
+    uint64_t offset;
+    uint64_t frames;
+    uint32_t channels;
+    uint32_t source_rate;      // of the file, the PCM is at the engine rate
+    uint64_t path_offset;      // of the file's NUL terminated path, from the start
+    int64_t file_mtime_ns;     // the file as it was decoded, the cache is stale
+    int64_t file_size;         // once either differs
+} PackCacheSample;
+
+// Start of a pack cache file, the source paths follow and the PCM starts
+// at data_offset. Keys refer to sources by index, -1 for none.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t is_multi;
+    uint32_t channels;
+    uint32_t samplerate;
+    uint32_t num_generic_press;
+    uint32_t num_sources;
+    uint64_t data_offset;      // bytes, page aligned
+    uint64_t data_samples;
+    char config_path[PATH_MAX];
+    char name[128];
+    PackCacheSample sources[MAX_PACK_SOURCES];
+    int32_t generic_press[5];
+    int32_t release;
+    int32_t key_press[256];     // key_sources in single mode
+    int32_t key_release[256];
+} PackCacheHeader;
+
+// How hard load-time resampling tries
+typedef enum {
+    RESAMPLE_FAST,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_BEST
+} ResampleQuality;
+
+static const char *resample_quality_names[] = { "fast", "medium", "best" };
+
+// Kaiser-windowed sinc for each quality
+typedef struct {
+    int zero_crossings;   // each side, at most RESAMPLE_MAX_ZERO_CROSSINGS
+    double beta;          // Kaiser window shape, higher is more stopband rejection
+    double cutoff;        // passband edge as a fraction of Nyquist
+} ResampleFilter;
+
+// The cutoff leaves room for half the transition band below Nyquist
+static const ResampleFilter resample_filters[] = {
+    { 16,  6.0, 0.87 },
+    { 32,  8.5, 0.91 },
+    { 64, 10.0, 0.95 },
+};
+
+// What load-time conversion cost for the current pack
+typedef struct {
+    int files;
+    uint64_t time_us;
+    size_t bytes_before;
+    size_t bytes_after;
+} ConversionStats;
+
+// One sample being played back by the mixer
 typedef struct {
+    SampleSource *sample;
+    const struct SoundPack *pack;   // the sample's pack, kept until the voice ends
+    size_t position;      // frames already mixed
+    uint64_t started;     // mixer frame the voice started on
+    int offset;           // silent frames before it starts, in its first period
+    int fade_frames;      // frames left while fading out after being stolen
+    int fade_total;
+    int peak;             // loudest sample of the last period
     int key_code;
-    SoundPack *sound_pack;
-    int thread_id;
-    int is_pressed;
-} PlaybackData; 
-
-// Global sound pack
-SoundPack g_sound_pack = {0};
-float g_volume = 1.0f;
+    int pressed;          // started by a press rather than a release
+    int active;
+} Voice;
+
+// What to do with a new sound when every voice is busy
+typedef enum {
+    STEAL_NONE,        // drop the new sound
+    STEAL_OLDEST,
+    STEAL_QUIETEST,
+    STEAL_RETRIGGER    // same key if it is playing, otherwise oldest
+} StealPolicy;
+
+static const char *steal_policy_names[] = { "none", "oldest", "quietest", "retrigger" };
+
+// What a key's new sound does to the sounds the same key is still playing
+typedef enum {
+    RETRIGGER_OVERLAP,    // nothing, they all ring out
+    RETRIGGER_CUT,        // a press fades out the key's previous sound
+    RETRIGGER_CAP,        // a press fades out the key's oldest beyond g_key_voice_cap
+    RETRIGGER_RELEASE     // a release fades out the key's ringing press
+} RetriggerPolicy;
+
+static const char *retrigger_policy_names[] = { "overlap", "cut", "cap", "release" };
+
+// Where a key event has been so far, CLOCK_MONOTONIC, 0 where unknown
+typedef struct {
+    uint64_t input_us;     // libinput timestamp
+    uint64_t sent_us;      // written to the pipe by get_key_presses
+    uint64_t read_us;      // read from the pipe by the player
+} EventTiming;
+
+// Key event handed from the stdin reader to the mixer
+typedef struct {
+    EventTiming timing;
+    uint64_t queued_us;    // pushed into the event queue
+    uint16_t key_code;
+    uint8_t is_pressed;
+} TriggerEvent;
+
+// Single-producer single-consumer ring: the reader only writes head,
+// the mixer only writes tail, so neither side ever waits on the other
+typedef struct {
+    TriggerEvent events[EVENT_QUEUE_SIZE];
+    unsigned head __attribute__((aligned(64)));
+    unsigned tail __attribute__((aligned(64)));
+    unsigned long overflows;   // events dropped because the ring was full
+} EventQueue;
+
+// Stages a keystroke goes through before its sound reaches the server
+typedef enum {
+    STAGE_INPUT,     // libinput timestamp -> sent by get_key_presses
+    STAGE_IPC,       // sent -> read by the player
+    STAGE_PARSE,     // read -> pushed into the event queue
+    STAGE_QUEUE,     // pushed -> picked up by the mixer
+    STAGE_OUTPUT,    // picked up -> first samples written to the server
+    STAGE_TOTAL,     // libinput timestamp -> first samples written
+    STAGE_SERVER,    // samples written -> heard, as the sound server measures it
+    STAGE_JITTER,    // scheduled start -> actual start, late sounds only add to it
+    STAGE_SUSPEND,   // idle mixer asks the output to stop -> it has stopped
+    STAGE_RESUME,    // key event queued while idle -> output running again
+    NUM_LATENCY_STAGES
+} LatencyStage;
+
+static const char *latency_stage_names[] = {
+    "input", "ipc", "parse", "queue", "output", "total", "server", "jitter",
+    "suspend", "resume"
+};
+
+// Updated with relaxed atomics from the reader and mixer threads
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t samples;
+    uint64_t sum_us;
+    uint64_t max_us;
+} LatencyHistogram;
+
+typedef struct {
+    LatencyHistogram latency[NUM_LATENCY_STAGES];
+    uint64_t events;
+    uint64_t voices_started;
+    uint64_t underruns;      // the output ran dry because the mixer fell behind
+    int peak_voices;
+    uint64_t idle_count;     // times the output was stopped for lack of sound
+    uint64_t idle_us;        // time spent stopped, not counting the current stop
+    uint64_t idle_since_us;  // when the current stop began, 0 while running
+    uint64_t ready_cpu_us;   // CPU time and allocations when input started
+    unsigned long ready_allocs;
+} PlayerStats;
+
+// Where mixed audio goes. write() blocks for as long as it takes to
+// keep the mixer about --latency-ms ahead of what is being heard.
+typedef struct {
+    const char *name;
+    int (*open)(const char *target);     // target is the part after "name:", or NULL
+    int (*write)(const short *samples, size_t frames);
+    void (*close)(int drain);
+    int reports_underruns;               // counts underruns itself, not from write timing
+    // Stop and restart the output around an idle mixer, NULL if it cannot
+    void (*suspend)(void);
+    int (*resume)(void);
+} OutputBackend;
+
+// Mixing kernels, picked once at startup from what the CPU supports.
+// Every variant must produce exactly the same output as the scalar one.
+typedef struct {
+    const char *name;
+    // acc[i] += src[i], returns the peak |sample| of src
+    int (*add)(int32_t *acc, const short *src, size_t samples);
+    // Same, but each mono frame is added to both channels of a stereo acc
+    int (*add_mono_to_stereo)(int32_t *acc, const short *src, size_t frames);
+    // out[i] = saturate(round(acc[i] * gain))
+    void (*gain_saturate)(short *out, const int32_t *acc, size_t samples, float gain);
+} MixKernels;
+
+// The pack the mixer plays from. Only the mixer changes it once it runs,
+// a reloaded pack is handed over through g_pending_pack.
+SoundPack *g_sound_pack = NULL;
+SoundPack *g_pending_pack = NULL;   // published by the reload thread
+SoundPack *g_retiring_pack = NULL;  // replaced, but voices still play from it
+SoundPack *g_retired_pack = NULL;   // handed back by the mixer once idle
+float g_volume = 1.0f;             // gain applied by the mixer, ramps towards the target
+float g_target_volume = 1.0f;      // set from the command line and the control socket
+int g_muted = 0;
+int g_paused = 0;                  // key events are ignored
+const char *g_control_path = NULL;
 int g_verbose = 0;
+int g_binary_input = 0;
+int g_inprocess = 0;
+PlayerStats g_stats = {0};
+const char *g_stats_path = NULL;
+const char *g_trace_path = NULL;
+const char *g_render_path = NULL;  // --render, a recorded session to mix offline
+const char *g_cache_dir = NULL;
+int g_use_cache = 1;
+int g_engine_rate = ENGINE_RATE;
+int g_engine_channels = MAX_OUTPUT_CHANNELS;
+ResampleQuality g_resample_quality = RESAMPLE_MEDIUM;
+ConversionStats g_conversion = {0};
+size_t g_memory_budget = 0;       // bytes of decoded PCM to keep, 0 to decode everything
+int g_lock_memory = 0;            // mlock sample data and mixer state
+int g_realtime_priority = 0;      // SCHED_FIFO priority of the mixer, 0 for a normal thread
+int g_mixer_cpu = -1;             // CPU the mixer is pinned to, -1 for any
+int g_output_latency_ms = OUTPUT_LATENCY_MS;
+uint64_t g_schedule_delay_us = SCHEDULE_DELAY_MS * 1000;   // 0 starts sounds at the next period
+int g_idle_ms = IDLE_TIMEOUT_MS;  // silence before the mixer stops the output, 0 never
+
+// Provided by bench_alloc.so when mechsim_bench preloads it
+extern unsigned long mechsim_alloc_count(void) __attribute__((weak));
+
+#ifdef MECHSIM_RT_DEBUG
+// make rtdebug: the mixer must not allocate or free once it renders, so
+// any of that on its thread aborts. The output backend's write is not
+// covered, libpulse allocates in there.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int in_render = 0;
+
+static void check_render_alloc() {
+    if (in_render) {
+        static const char message[] = "Allocation on the render thread, aborting\n";
+        ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+        (void)written;
+        abort();
+    }
+}
+
+void *malloc(size_t size) {
+    check_render_alloc();
+    return __libc_malloc(size);
+}
 
-// Thread pool for sound playback
-pthread_t sound_threads[MAX_CONCURRENT_SOUNDS];
-volatile int thread_active[MAX_CONCURRENT_SOUNDS] = {0};
-pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+void *calloc(size_t count, size_t size) {
+    check_render_alloc();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    check_render_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) check_render_alloc();
+    __libc_free(ptr);
+}
+
+#define RENDER_SECTION(on) (in_render = (on))
+#else
+#define RENDER_SECTION(on) ((void)0)
+#endif
+
+// Mixer: one long-lived output stream that all voices are summed into.
+// Voices are owned by the mixer thread; everyone else goes through g_events.
+const OutputBackend *g_output = NULL;
+const char *g_output_target = NULL;
+int g_output_open = 0;
+pa_sample_spec g_output_spec = { .format = PA_SAMPLE_S16LE };
+Voice *g_voices = NULL;           // pool plus STEAL_FADE_VOICES spare slots
+int g_voice_pool_size = MAX_CONCURRENT_SOUNDS;
+StealPolicy g_steal_policy = STEAL_OLDEST;
+uint64_t g_mixer_frame = 0;
+const MixKernels *g_mix_kernels = NULL;
+int g_active_voices = 0;
+unsigned long g_voices_stolen = 0;
+unsigned long g_voices_dropped = 0;
+unsigned long g_voices_cut = 0;           // faded by their key's retrigger policy
+unsigned long g_events_throttled = 0;
+RetriggerPolicy g_retrigger_policy = RETRIGGER_OVERLAP;
+RetriggerPolicy g_key_retrigger[256];     // per key, g_retrigger_policy unless overridden
+int g_key_voice_cap = KEY_VOICE_CAP;
+int g_max_event_rate = 0;                 // voice starts per second, 0 for no limit
+EventQueue g_events = {0};
+pthread_t mixer_thread;
+volatile int g_mixer_running = 0;
+sem_t mixer_wakeup;               // posted to a mixer that sleeps with the output stopped
+int g_mixer_sleeping = 0;
+
+// Anyone handing the mixer work, once it is visible to the mixer: wake it
+// if it went idle. Never blocks, so the reader threads can call it.
+static void wake_mixer() {
+    if (__atomic_exchange_n(&g_mixer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        sem_post(&mixer_wakeup);
+    }
+}
 
 // Function to construct a full path
 static void get_full_path(char *buffer, size_t buffer_size, const char *base_dir, const char *filename) {
@@ -69,7 +464,7 @@ static void get_full_path(char *buffer, size_t buffer_size, const char *base_dir
 }
 
 
-int load_sound_config(const char *config_path) {
+int load_sound_config(SoundPack *pack, const char *config_path) {
     FILE *file = fopen(config_path, "r");
     if (!file) {
         fprintf(stderr, "Error: Cannot open config file: %s\n", config_path);
@@ -107,15 +502,17 @@ int load_sound_config(const char *config_path) {
 
     const char *key_type = "single";
     json_object *obj;
+    if (json_object_object_get_ex(root, "name", &obj))
+        snprintf(pack->name, sizeof(pack->name), "%s", json_object_get_string(obj));
     if (json_object_object_get_ex(root, "key_define_type", &obj))
         key_type = json_object_get_string(obj);
 
-    g_sound_pack.is_multi = strcmp(key_type, "multi") == 0;
-    printf("Config loaded: Using %s mode\n", g_sound_pack.is_multi ? "multi" : "single");
+    pack->is_multi = strcmp(key_type, "multi") == 0;
+    printf("Config loaded: Using %s mode\n", pack->is_multi ? "multi" : "single");
 
-    if (g_sound_pack.is_multi) {
+    if (pack->is_multi) {
         // Reset counter
-        g_sound_pack.num_generic_press_files = 0;
+        pack->num_generic_press_files = 0;
         
         if (json_object_object_get_ex(root, "sound", &obj)) {
             const char *pattern = json_object_get_string(obj);
@@ -146,35 +543,35 @@ int load_sound_config(const char *config_path) {
                     }
                     
                     // Construct the full path using the config directory
-                    get_full_path(g_sound_pack.generic_press_files[i], sizeof(g_sound_pack.generic_press_files[i]), config_dir, temp_filename);
+                    get_full_path(pack->generic_press_files[i], sizeof(pack->generic_press_files[i]), config_dir, temp_filename);
 
                     // Check if file exists before adding to count
-                    if (access(g_sound_pack.generic_press_files[i], R_OK) == 0) {
-                        g_sound_pack.num_generic_press_files = i + 1;  // Keep track of highest valid index + 1
-                        // printf("Found generic sound file: %s\n", g_sound_pack.generic_press_files[i]);
+                    if (access(pack->generic_press_files[i], R_OK) == 0) {
+                        pack->num_generic_press_files = i + 1;  // Keep track of highest valid index + 1
+                        // printf("Found generic sound file: %s\n", pack->generic_press_files[i]);
                     } else {
-                        printf("Generic sound file not found: %s\n", g_sound_pack.generic_press_files[i]);
+                        printf("Generic sound file not found: %s\n", pack->generic_press_files[i]);
                         break;  // Stop at first missing file
                     }
                 }
             } else {
                 // Direct filename, no pattern
-                get_full_path(g_sound_pack.generic_press_files[0], sizeof(g_sound_pack.generic_press_files[0]), config_dir, pattern);
-                if (access(g_sound_pack.generic_press_files[0], R_OK) == 0) {
-                    g_sound_pack.num_generic_press_files = 1;
-                    printf("Found single generic sound file: %s\n", g_sound_pack.generic_press_files[0]);
+                get_full_path(pack->generic_press_files[0], sizeof(pack->generic_press_files[0]), config_dir, pattern);
+                if (access(pack->generic_press_files[0], R_OK) == 0) {
+                    pack->num_generic_press_files = 1;
+                    printf("Found single generic sound file: %s\n", pack->generic_press_files[0]);
                 }
             }
             
-            printf("Total generic press sound files: %d\n", g_sound_pack.num_generic_press_files);
+            printf("Total generic press sound files: %d\n", pack->num_generic_press_files);
         }
         
         if (json_object_object_get_ex(root, "soundup", &obj)) {
             char temp_release_file[256];
             strncpy(temp_release_file, json_object_get_string(obj), sizeof(temp_release_file) - 1);
             temp_release_file[sizeof(temp_release_file) - 1] = '\0';
-            get_full_path(g_sound_pack.release_file, sizeof(g_sound_pack.release_file), config_dir, temp_release_file);
-            printf("Release sound file: %s\n", g_sound_pack.release_file);
+            get_full_path(pack->release_file, sizeof(pack->release_file), config_dir, temp_release_file);
+            printf("Release sound file: %s\n", pack->release_file);
         }
 
         if (json_object_object_get_ex(root, "defines", &obj)) {
@@ -195,20 +592,23 @@ int load_sound_config(const char *config_path) {
 
                 if (key_code >= 0 && key_code < 256) {
                     const char *filename_relative = json_object_get_string(val);
+                    if (!filename_relative) {
+                        continue;  // Keys mapped to null have no sound
+                    }
                     char full_filename[MAX_LINE_LENGTH];
                     get_full_path(full_filename, sizeof(full_filename), config_dir, filename_relative);
                     // printf("Key %d (%s): %s (full path: %s)\n", key_code, is_release ? "release" : "press", filename_relative, full_filename);
                     
                     if (is_release) {
-                        if (g_sound_pack.multi_key_mappings[key_code].release) {
-                            free(g_sound_pack.multi_key_mappings[key_code].release);
+                        if (pack->multi_key_mappings[key_code].release) {
+                            free(pack->multi_key_mappings[key_code].release);
                         }
-                        g_sound_pack.multi_key_mappings[key_code].release = strdup(full_filename);
+                        pack->multi_key_mappings[key_code].release = strdup(full_filename);
                     } else {
-                        if (g_sound_pack.multi_key_mappings[key_code].press) {
-                            free(g_sound_pack.multi_key_mappings[key_code].press);
+                        if (pack->multi_key_mappings[key_code].press) {
+                            free(pack->multi_key_mappings[key_code].press);
                         }
-                        g_sound_pack.multi_key_mappings[key_code].press = strdup(full_filename);
+                        pack->multi_key_mappings[key_code].press = strdup(full_filename);
                     }
                 }
             }
@@ -218,8 +618,8 @@ int load_sound_config(const char *config_path) {
             char temp_sound_file[256];
             strncpy(temp_sound_file, json_object_get_string(obj), sizeof(temp_sound_file) - 1);
             temp_sound_file[sizeof(temp_sound_file) - 1] = '\0';
-            get_full_path(g_sound_pack.sound_file, sizeof(g_sound_pack.sound_file), config_dir, temp_sound_file);
-            printf("Single mode sound file: %s\n", g_sound_pack.sound_file);
+            get_full_path(pack->sound_file, sizeof(pack->sound_file), config_dir, temp_sound_file);
+            printf("Single mode sound file: %s\n", pack->sound_file);
         }
 
         if (json_object_object_get_ex(root, "defines", &obj)) {
@@ -228,8 +628,8 @@ int load_sound_config(const char *config_path) {
                 if (key_code >= 0 && key_code < 256 && 
                     json_object_is_type(val, json_type_array) &&
                     json_object_array_length(val) >= 2) {
-                    g_sound_pack.key_mappings[key_code].start_ms = json_object_get_int(json_object_array_get_idx(val, 0));
-                    g_sound_pack.key_mappings[key_code].duration_ms = json_object_get_int(json_object_array_get_idx(val, 1));
+                    pack->key_mappings[key_code].start_ms = json_object_get_int(json_object_array_get_idx(val, 0));
+                    pack->key_mappings[key_code].duration_ms = json_object_get_int(json_object_array_get_idx(val, 1));
                 }
             }
         }
@@ -239,375 +639,3943 @@ int load_sound_config(const char *config_path) {
     return 0;
 }
 
-int init_audio() {
-    // For multi mode, we don't need to check a single sound file
-    if (g_sound_pack.is_multi) {
-        // printf("Multi mode: Audio will be initialized per sound file\n");
-        return 0;
-    }
-    
-    // For single mode, check the main sound file
-    if (strlen(g_sound_pack.sound_file) == 0) {
-        fprintf(stderr, "Error: No sound file specified in config\n");
-        return -1;
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// --mlock: keep sample data and mixer state in RAM, so the mixer never
+// waits for a page to come back from disk or swap. Warns once.
+static void lock_memory(const void *data, size_t bytes) {
+    static int warned = 0;
+    if (!g_lock_memory || bytes == 0) {
+        return;
     }
-    
-    if (access(g_sound_pack.sound_file, R_OK) != 0) {
-        fprintf(stderr, "Sound file not accessible: %s\n", g_sound_pack.sound_file);
-        perror("access");
-        return -1;
+    if (mlock(data, bytes) != 0 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "Warning: Cannot lock sample memory (%s), raise the limit with ulimit -l\n",
+                strerror(errno));
     }
+}
 
-    // Test open sound file to get info
-    SNDFILE *test_sf = sf_open(g_sound_pack.sound_file, SFM_READ, &g_sound_pack.sf_info);
-    if (!test_sf) {
-        fprintf(stderr, "Could not open sound file: %s\n", g_sound_pack.sound_file);
-        fprintf(stderr, "libsndfile error: %s\n", sf_strerror(NULL));
-        return -1;
+// Kaiser-windowed sinc, one side, RESAMPLE_TABLE_RES points per zero crossing
+static float resample_table[RESAMPLE_MAX_ZERO_CROSSINGS * RESAMPLE_TABLE_RES + 2];
+static int resample_table_quality = -1;
+
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 64; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
     }
-    sf_close(test_sf);
+    return sum;
+}
 
-    printf("Sound file info: %ld frames, %d channels, %d Hz\n", 
-           g_sound_pack.sf_info.frames, g_sound_pack.sf_info.channels, g_sound_pack.sf_info.samplerate);
+static void build_resample_table() {
+    const ResampleFilter *filter = &resample_filters[g_resample_quality];
+    int points = filter->zero_crossings * RESAMPLE_TABLE_RES;
 
-    return 0;
+    for (int i = 0; i <= points; i++) {
+        double x = (double)i / RESAMPLE_TABLE_RES;
+        double w = (double)i / points;
+        double sinc = i == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        resample_table[i] = (float)(sinc * bessel_i0(filter->beta * sqrt(1.0 - w * w)) /
+                                    bessel_i0(filter->beta));
+    }
+    resample_table[points + 1] = 0.0f;    // lets the lookup interpolate past the end
+    resample_table_quality = g_resample_quality;
 }
 
-void* play_sound_thread(void* arg) {
-    PlaybackData *data = (PlaybackData*)arg;
-    int key_code = data->key_code;
-    int thread_id = data->thread_id;
-    int is_pressed = data->is_pressed;
+// Band-limited resampling of interleaved PCM, returns a malloc'd buffer
+static short *resample_pcm(const short *in, size_t in_frames, int channels,
+                           int in_rate, int out_rate, size_t *out_frames) {
+    if (resample_table_quality != (int)g_resample_quality) {
+        build_resample_table();
+    }
+    const ResampleFilter *filter = &resample_filters[g_resample_quality];
 
-    const char *file_to_play = NULL;
+    // Cut off below the lower of the two Nyquist rates, so downsampling cannot alias
+    double cutoff = filter->cutoff * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+    long half_width = (long)ceil(filter->zero_crossings / cutoff);
+    double table_limit = filter->zero_crossings * RESAMPLE_TABLE_RES;
 
-    if (g_verbose) {
-        printf("Thread %d: Playing sound for key %d (%s)\n", 
-               thread_id, key_code, is_pressed ? "press" : "release");
+    size_t frames = (size_t)(((uint64_t)in_frames * out_rate + in_rate - 1) / in_rate);
+    short *out = malloc(frames * channels * sizeof(short));
+    if (!out) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
     }
 
-    if (g_sound_pack.is_multi) {
-        // First try exact match
-        if (is_pressed && g_sound_pack.multi_key_mappings[key_code].press) {
-            file_to_play = g_sound_pack.multi_key_mappings[key_code].press;
-        } else if (!is_pressed && g_sound_pack.multi_key_mappings[key_code].release) {
-            file_to_play = g_sound_pack.multi_key_mappings[key_code].release;
-        } else if (is_pressed && g_sound_pack.num_generic_press_files > 0) {
-            // Fallback: random generic press
-            int idx = rand() % g_sound_pack.num_generic_press_files;
-            file_to_play = g_sound_pack.generic_press_files[idx];
-        } else if (!is_pressed && strlen(g_sound_pack.release_file) > 0) {
-            file_to_play = g_sound_pack.release_file;
-        }
+    for (size_t n = 0; n < frames; n++) {
+        // Exact position in the input, kept in integers so long files do not drift
+        uint64_t position = (uint64_t)n * in_rate;
+        long center = (long)(position / out_rate);
+        double frac = (double)(position % out_rate) / out_rate;
 
-        if (!file_to_play) {
-            if (g_verbose) {
-                printf("Thread %d: No sound file found for key %d (%s)\n", 
-                       thread_id, key_code, is_pressed ? "press" : "release");
+        float acc[MAX_OUTPUT_CHANNELS] = {0};
+        long first = center - half_width + 1 > 0 ? center - half_width + 1 : 0;
+        long last = center + half_width < (long)in_frames - 1 ? center + half_width : (long)in_frames - 1;
+        for (long i = first; i <= last; i++) {
+            double t = fabs((i - center - frac) * cutoff) * RESAMPLE_TABLE_RES;
+            if (t >= table_limit) continue;
+            size_t index = (size_t)t;
+            float h = resample_table[index] + (resample_table[index + 1] - resample_table[index]) * (float)(t - index);
+            for (int c = 0; c < channels; c++) {
+                acc[c] += h * in[i * channels + c];
             }
-            goto exit_cleanup;
-        }
-
-        if (g_verbose) {
-            printf("Thread %d: Using sound file: %s\n", thread_id, file_to_play);
         }
 
-        SF_INFO sf_info = {0};
-        SNDFILE *sf = sf_open(file_to_play, SFM_READ, &sf_info);
-        if (!sf) {
-            fprintf(stderr, "Could not open sound file: %s (Error: %s)\n", 
-                    file_to_play, sf_strerror(NULL));
-            goto exit_cleanup;
+        for (int c = 0; c < channels; c++) {
+            long value = lrintf(acc[c] * (float)cutoff);
+            out[n * channels + c] = value > 32767 ? 32767 : value < -32768 ? -32768 : (short)value;
         }
+    }
 
-        pa_sample_spec ss = {
-            .format = PA_SAMPLE_S16LE,
-            .rate = sf_info.samplerate,
-            .channels = sf_info.channels
-        };
-
-        int pa_error;
-        pa_simple *pa_handle = pa_simple_new(NULL, "KeyboardSounds", PA_STREAM_PLAYBACK,
-                                             NULL, "playback", &ss, NULL, NULL, &pa_error);
-        if (!pa_handle) {
-            fprintf(stderr, "Could not initialize PulseAudio: %s\n", pa_strerror(pa_error));
-            sf_close(sf);
-            goto exit_cleanup;
-        }
+    *out_frames = frames;
+    return out;
+}
 
-        int frames = 2048;
-        short *buffer = malloc(frames * sf_info.channels * sizeof(short));
-        if (!buffer) {
-            pa_simple_free(pa_handle);
-            sf_close(sf);
-            goto exit_cleanup;
-        }
+// Bring a freshly decoded buffer to the engine format, replacing it when it
+// has to be resampled. Wider files are downmixed; mono stays mono, the mixer
+// spreads it for free. Called from every decode worker at once.
+static int convert_pcm(short **pcm, size_t *frames, int *channels, int samplerate) {
+    if (*channels <= g_engine_channels && samplerate == g_engine_rate) {
+        return 0;
+    }
 
-        sf_count_t read;
-        while ((read = sf_readf_short(sf, buffer, frames)) > 0) {
-            for (sf_count_t i = 0; i < read * sf_info.channels; i++) {
-                buffer[i] = (short)(buffer[i] * g_volume);
-            }
-            
-            int pa_write_error;
-            if (pa_simple_write(pa_handle, buffer, read * sf_info.channels * sizeof(short), &pa_write_error) < 0) {
-                fprintf(stderr, "PulseAudio write error: %s\n", pa_strerror(pa_write_error));
-                break;
-            }
-        }
+    uint64_t start_us = monotonic_us();
+    size_t bytes_before = *frames * *channels * sizeof(short);
+    short *data = *pcm;
 
-        int pa_drain_error;
-        pa_simple_drain(pa_handle, &pa_drain_error);
-        pa_simple_free(pa_handle);
-        sf_close(sf);
-        free(buffer);
-    } else {
-        if (key_code >= 256 || g_sound_pack.key_mappings[key_code].duration_ms == 0) {
-            if (g_verbose) {
-                printf("Thread %d: No mapping for key %d\n", thread_id, key_code);
+    if (*channels > g_engine_channels) {
+        // In place, each frame only ever moves towards the front
+        for (size_t f = 0; f < *frames; f++) {
+            const short *frame = data + f * *channels;
+            if (g_engine_channels == 1) {
+                int sum = 0;
+                for (int c = 0; c < *channels; c++) sum += frame[c];
+                data[f] = (short)(sum / *channels);
+            } else {
+                // Front left and right
+                short left = frame[0], right = frame[1];
+                data[f * 2] = left;
+                data[f * 2 + 1] = right;
             }
-            goto exit_cleanup;
         }
+        *channels = g_engine_channels;
+    }
 
-        SoundMapping *mapping = &g_sound_pack.key_mappings[key_code];
-
-        SF_INFO sf_info = g_sound_pack.sf_info;
-        SNDFILE *sf = sf_open(g_sound_pack.sound_file, SFM_READ, &sf_info);
-        if (!sf) {
-            fprintf(stderr, "Thread: Could not open sound file\n");
-            goto exit_cleanup;
+    if (samplerate != g_engine_rate) {
+        size_t resampled_frames;
+        short *resampled = resample_pcm(data, *frames, *channels, samplerate, g_engine_rate,
+                                        &resampled_frames);
+        if (!resampled) {
+            return -1;
         }
+        free(data);
+        *pcm = resampled;
+        *frames = resampled_frames;
+    }
 
-        pa_sample_spec ss = {
-            .format = PA_SAMPLE_S16LE,
-            .rate = sf_info.samplerate,
-            .channels = sf_info.channels
-        };
+    __atomic_fetch_add(&g_conversion.files, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_conversion.time_us, monotonic_us() - start_us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_conversion.bytes_before, bytes_before, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_conversion.bytes_after, *frames * *channels * sizeof(short), __ATOMIC_RELAXED);
+    return 0;
+}
 
-        int pa_error;
-        pa_simple *pa_handle = pa_simple_new(NULL, "KeyboardSounds", PA_STREAM_PLAYBACK,
-                                             NULL, "playback", &ss, NULL, NULL, &pa_error);
-        if (!pa_handle) {
-            sf_close(sf);
-            fprintf(stderr, "Thread: Could not initialize PulseAudio: %s\n", pa_strerror(pa_error));
-            goto exit_cleanup;
-        }
+// Read a source's file, or its segment of it, at the file's own rate
+static short *read_source_pcm(const SampleSource *source, SF_INFO *sf_info, size_t *out_frames) {
+    uint64_t open_us = key_trace_enabled() ? monotonic_us() : 0;
+    SNDFILE *sf = sf_open(source->path, SFM_READ, sf_info);
+    if (open_us) {
+        key_trace_span("sf_open", open_us, monotonic_us());
+    }
+    if (!sf) {
+        fprintf(stderr, "Could not open sound file: %s (Error: %s)\n", source->path, sf_strerror(NULL));
+        return NULL;
+    }
 
-        sf_count_t start_frame = (mapping->start_ms * sf_info.samplerate) / 1000;
-        sf_count_t duration_frames = (mapping->duration_ms * sf_info.samplerate) / 1000;
+    sf_count_t skip = 0, wanted = -1;
+    if (source->duration_ms > 0) {
+        skip = (sf_count_t)source->start_ms * sf_info->samplerate / 1000;
+        wanted = (sf_count_t)source->duration_ms * sf_info->samplerate / 1000;
+    }
 
-        sf_seek(sf, start_frame, SEEK_SET);
+    // Frame counts are only estimates for some formats, so read until EOF
+    size_t capacity = wanted >= 0 ? (size_t)wanted : (size_t)(sf_info->frames > 0 ? sf_info->frames : 0);
+    if (capacity < 4096) capacity = 4096;
+    short *pcm = malloc(capacity * sf_info->channels * sizeof(short));
+    if (!pcm) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        sf_close(sf);
+        return NULL;
+    }
 
-        short *buffer = malloc(duration_frames * sf_info.channels * sizeof(short));
-        if (!buffer) {
-            pa_simple_free(pa_handle);
-            sf_close(sf);
-            goto exit_cleanup;
+    if (skip > 0 && sf_seek(sf, skip, SEEK_SET) < 0) {
+        // Not seekable, read up to the segment instead
+        while (skip > 0) {
+            sf_count_t read = sf_readf_short(sf, pcm, skip < (sf_count_t)capacity ? skip : (sf_count_t)capacity);
+            if (read <= 0) break;
+            skip -= read;
         }
-        
-        sf_count_t frames_read = sf_readf_short(sf, buffer, duration_frames);
+    }
 
-        for (sf_count_t i = 0; i < frames_read * sf_info.channels; i++) {
-            buffer[i] = (short)(buffer[i] * g_volume);
+    size_t frames = 0;
+    while (wanted < 0 || frames < (size_t)wanted) {
+        if (frames == capacity) {
+            short *grown = realloc(pcm, capacity * 2 * sf_info->channels * sizeof(short));
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                free(pcm);
+                sf_close(sf);
+                return NULL;
+            }
+            pcm = grown;
+            capacity *= 2;
         }
 
-        int pa_write_error, pa_drain_error;
-        pa_simple_write(pa_handle, buffer, frames_read * sf_info.channels * sizeof(short), &pa_write_error);
-        pa_simple_drain(pa_handle, &pa_drain_error);
-
-        free(buffer);
-        pa_simple_free(pa_handle);
-        sf_close(sf);
+        sf_count_t chunk = (sf_count_t)(capacity - frames);
+        if (wanted >= 0 && chunk > wanted - (sf_count_t)frames) chunk = wanted - (sf_count_t)frames;
+        sf_count_t read = sf_readf_short(sf, pcm + frames * sf_info->channels, chunk);
+        if (read <= 0) break;
+        frames += read;
     }
+    sf_close(sf);
 
-exit_cleanup:
-    pthread_mutex_lock(&thread_mutex);
-    thread_active[thread_id] = 0;
-    pthread_mutex_unlock(&thread_mutex);
-    free(data);
-    return NULL;
+    *out_frames = frames;
+    return pcm;
 }
 
-int find_available_thread_slot() {
-    pthread_mutex_lock(&thread_mutex);
-    
-    // Find available slot
-    for (int i = 0; i < MAX_CONCURRENT_SOUNDS; i++) {
-        if (!thread_active[i]) {
-            pthread_mutex_unlock(&thread_mutex);
-            return i;
-        }
+// Decode and convert one source. It is marked ready even when that fails,
+// so the keys using it stop waiting and fall back for good.
+static void decode_source(SampleSource *source) {
+    uint64_t start_us = key_trace_enabled() ? monotonic_us() : 0;
+    struct stat file_st;
+    if (stat(source->path, &file_st) == 0) {
+        source->file_mtime_ns = (int64_t)file_st.st_mtim.tv_sec * 1000000000 + file_st.st_mtim.tv_nsec;
+        source->file_size = file_st.st_size;
+    }
+    SF_INFO sf_info = {0};
+    size_t frames = 0;
+    short *pcm = read_source_pcm(source, &sf_info, &frames);
+    int channels = sf_info.channels;
+
+    // The mixer sums everything directly, so convert once here
+    if (pcm && frames > 0 && convert_pcm(&pcm, &frames, &channels, sf_info.samplerate) != 0) {
+        frames = 0;
+    }
+    if (frames == 0) {
+        free(pcm);
+        pcm = NULL;
+    } else {
+        // Give back the slack from reading in chunks
+        short *shrunk = realloc(pcm, frames * channels * sizeof(short));
+        if (shrunk) pcm = shrunk;
+    }
+
+    lock_memory(pcm, frames * channels * sizeof(short));
+    source->data = pcm;
+    source->frames = frames;
+    source->channels = channels;
+    source->source_rate = sf_info.samplerate;
+    source->owned = 1;
+    if (g_verbose && pcm) {
+        printf("Decoded %s: %zu frames, %d channels, %d Hz\n",
+               source->path, frames, channels, g_engine_rate);
+    }
+    __atomic_store_n(&source->ready, 1, __ATOMIC_RELEASE);
+    if (start_us) {
+        key_trace_span("decode", start_us, monotonic_us());
     }
-    
-    pthread_mutex_unlock(&thread_mutex);
-    return -1; // No available slots
 }
 
-void play_sound_segment(int key_code, int is_pressed) {
-    // Only play sound on key press in single mode
-    if (!g_sound_pack.is_multi && !is_pressed) {
-        if (g_verbose) {
-            printf("Single mode: Ignoring key release for key %d\n", key_code);
+// Find or add the source for a file segment, so keys sharing one decode it once
+static SampleSource *pack_source(SoundPack *pack, const char *path, int start_ms, int duration_ms) {
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        SampleSource *source = &pack->store.sources[i];
+        if (source->start_ms == start_ms && source->duration_ms == duration_ms &&
+            strcmp(source->path, path) == 0) {
+            return source;
         }
-        return;
     }
 
-    int slot = find_available_thread_slot();
-    if (slot == -1) {
-        if (g_verbose) {
-            printf("Warning: No available thread slots\n");
-        }
-        return;
+    if (pack->store.num_sources >= MAX_PACK_SOURCES) {
+        return NULL;
     }
+    SampleSource *source = &pack->store.sources[pack->store.num_sources];
+    source->path = strdup(path);
+    if (!source->path) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    source->start_ms = start_ms;
+    source->duration_ms = duration_ms;
+    pack->store.num_sources++;
+    return source;
+}
 
-    PlaybackData *data = malloc(sizeof(PlaybackData));
-    if (!data) return;
+// Decode workers. Each claims the next source in order, so where every
+// sample lands only depends on the config, not on which worker got it.
+static pthread_t decode_threads[MAX_DECODE_WORKERS];
+static int num_decode_threads = 0;
+static int decode_workers = 0;      // for the report, set before any worker starts
+static int decode_next = 0;
+static int decode_pending = 0;       // sources not ready yet
+static int decode_cancel = 0;
+static uint64_t decode_start_us = 0;
+static SoundPack *decode_pack = NULL;
+static int decode_write_cache = 0;     // compile the pack once it is decoded
+static int decode_cache_result = 0;
 
-    data->key_code = key_code;
-    data->sound_pack = &g_sound_pack;
-    data->thread_id = slot;
-    data->is_pressed = is_pressed;
+int write_pack_cache(const SoundPack *pack);
 
-    pthread_mutex_lock(&thread_mutex);
-    thread_active[slot] = 1;
+static size_t sample_store_bytes(const SoundPack *pack) {
+    size_t bytes = 0;
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        bytes += pack->store.sources[i].frames * pack->store.sources[i].channels * sizeof(short);
+    }
+    return bytes;
+}
 
-    if (pthread_create(&sound_threads[slot], NULL, play_sound_thread, data) != 0) {
-        thread_active[slot] = 0;
-        free(data);
-        fprintf(stderr, "Failed to create sound thread\n");
-    } else {
-        pthread_detach(sound_threads[slot]);
+// Run by whichever worker finishes the last source
+static void finish_decoding(const SoundPack *pack) {
+    int workers = __atomic_load_n(&decode_workers, __ATOMIC_RELAXED);
+    printf("Decoded %d sounds into %zu KB of PCM in %.1f ms with %d worker%s\n",
+           pack->store.num_sources, sample_store_bytes(pack) / 1024,
+           (monotonic_us() - decode_start_us) / 1000.0, workers, workers == 1 ? "" : "s");
+    if (g_conversion.files > 0) {
+        printf("Converted %d files to %d Hz (%s quality) in %.1f ms: %zu KB -> %zu KB\n",
+               g_conversion.files, g_engine_rate, resample_quality_names[g_resample_quality],
+               g_conversion.time_us / 1000.0, g_conversion.bytes_before / 1024,
+               g_conversion.bytes_after / 1024);
     }
+    fflush(stdout);
 
-    pthread_mutex_unlock(&thread_mutex);
+    if (decode_write_cache) {
+        decode_cache_result = write_pack_cache(pack);
+    }
 }
 
-int parse_keyboard_event(const char *json_line, int *key_code, int *is_pressed) {
-    // Strip newline if present
-    char *line_copy = strdup(json_line);
-    if (!line_copy) return -1;
-    
-    char *newline = strchr(line_copy, '\n');
-    if (newline) *newline = '\0';
-    
-    if (g_verbose) {
-        printf("Parsing JSON: %s\n", line_copy);
+static void *decode_worker_main(void *arg) {
+    SoundPack *pack = arg;
+    key_trace_thread("decode");
+    while (!__atomic_load_n(&decode_cancel, __ATOMIC_RELAXED)) {
+        int index = __atomic_fetch_add(&decode_next, 1, __ATOMIC_RELAXED);
+        if (index >= pack->store.num_sources) {
+            break;
+        }
+        decode_source(&pack->store.sources[index]);
+        if (__atomic_sub_fetch(&decode_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            finish_decoding(pack);
+        }
     }
+    return NULL;
+}
 
-    json_object *root = json_tokener_parse(line_copy);
-    free(line_copy);
-    
-    if (!root) {
-        fprintf(stderr, "Failed to parse JSON: %s\n", json_line);
+// Wait for the workers, returns the result of writing the pack cache
+static int wait_for_decoding() {
+    for (int i = 0; i < num_decode_threads; i++) {
+        pthread_join(decode_threads[i], NULL);
+    }
+    num_decode_threads = 0;
+    decode_pack = NULL;
+    return decode_cache_result;
+}
+
+// With a memory budget, sources are decoded on first use by a single
+// residency thread instead, and the least recently used ones are freed
+// again to stay under the budget. The mixer only ever asks for a source,
+// it never waits for one. The budget covers every pack still alive, each
+// residency thread only evicts from its own.
+static uint64_t use_clock = 0;
+static size_t resident_bytes = 0;
+static unsigned long residency_decodes = 0;
+static unsigned long residency_evictions = 0;
+
+// Mixer thread: queue a source that is not resident, never blocks
+static void source_request(SoundPack *pack, SampleSource *source) {
+    if (!__atomic_load_n(&pack->residency.running, __ATOMIC_ACQUIRE) || !source) {
+        return;
+    }
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&source->requested, &expected, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        sem_post(&pack->residency.wakeup);
+    }
+}
+
+// Free a source nobody is playing. Clearing ready before looking at playing
+// pairs with source_acquire, which counts itself before looking at ready,
+// so one of the two always sees the other.
+static int evict_source(SoundPack *pack, SampleSource *source) {
+    __atomic_store_n(&source->ready, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&source->playing, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_store_n(&source->ready, 1, __ATOMIC_RELEASE);
         return -1;
     }
 
-    json_object *key_code_obj, *state_code_obj;
-    
-    if (json_object_object_get_ex(root, "key_code", &key_code_obj) &&
-        json_object_object_get_ex(root, "state_code", &state_code_obj)) {
-        
-        *key_code = json_object_get_int(key_code_obj);
-        *is_pressed = json_object_get_int(state_code_obj);
-        
-        if (g_verbose) {
-            printf("Parsed key event: key_code=%d, is_pressed=%d\n", *key_code, *is_pressed);
+    size_t bytes = source->frames * source->channels * sizeof(short);
+    free(source->data);
+    source->data = NULL;
+    source->frames = 0;
+    pack->residency.bytes -= bytes;
+    __atomic_fetch_sub(&resident_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&residency_evictions, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Evict least recently used sources until the budget fits, or nothing more can go
+static void evict_to_budget(SoundPack *pack) {
+    uint64_t skip_before = 0;   // sources in use are skipped on the next pass
+    while (__atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) > g_memory_budget) {
+        SampleSource *oldest = NULL;
+        uint64_t oldest_used = 0;
+        for (int i = 0; i < pack->store.num_sources; i++) {
+            SampleSource *source = &pack->store.sources[i];
+            uint64_t last_used = __atomic_load_n(&source->last_used, __ATOMIC_RELAXED);
+            if (source->pinned || !source->owned || source->frames == 0 || last_used < skip_before ||
+                !__atomic_load_n(&source->ready, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (!oldest || last_used < oldest_used) {
+                oldest = source;
+                oldest_used = last_used;
+            }
+        }
+        if (!oldest) {
+            return;
+        }
+        if (evict_source(pack, oldest) != 0) {
+            skip_before = oldest_used + 1;
         }
-        
-        json_object_put(root);
-        return 0;
     }
+}
 
-    json_object_put(root);
-    return -1;
+// Decode what the mixer asked for, then get back under the budget
+static void residency_batch(SoundPack *pack) {
+    int decoded = 0;
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        SampleSource *source = &pack->store.sources[i];
+        if (!__atomic_load_n(&source->requested, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (!__atomic_load_n(&source->ready, __ATOMIC_ACQUIRE)) {
+            decode_source(source);
+            size_t bytes = source->frames * source->channels * sizeof(short);
+            pack->residency.bytes += bytes;
+            __atomic_fetch_add(&resident_bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&residency_decodes, 1, __ATOMIC_RELAXED);
+            decoded++;
+            __atomic_store_n(&source->last_used, __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&source->requested, 0, __ATOMIC_RELEASE);
+    }
+    evict_to_budget(pack);
+
+    if (!pack->residency.prefetched) {
+        pack->residency.prefetched = 1;
+        printf("Prefetched %d sounds, %zu KB resident of a %zu KB budget, the rest decode on first use\n",
+               decoded, __atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) / 1024,
+               g_memory_budget / 1024);
+        fflush(stdout);
+    }
 }
 
-void cleanup() {
-    printf("Cleaning up...\n");
-    
-    // Give threads a moment to finish naturally
-    usleep(500000); // 500ms
+static void *residency_thread_main(void *arg) {
+    SoundPack *pack = arg;
+    key_trace_thread("residency");
 
-    // Free dynamically allocated filenames in multi config
-    for (int i = 0; i < 256; i++) {
-        if (g_sound_pack.multi_key_mappings[i].press) {
-            free(g_sound_pack.multi_key_mappings[i].press);
-            g_sound_pack.multi_key_mappings[i].press = NULL;
+    while (1) {
+        while (sem_wait(&pack->residency.wakeup) != 0 && errno == EINTR) {
         }
-        if (g_sound_pack.multi_key_mappings[i].release) {
-            free(g_sound_pack.multi_key_mappings[i].release);
-            g_sound_pack.multi_key_mappings[i].release = NULL;
+        if (__atomic_load_n(&pack->residency.stop, __ATOMIC_RELAXED)) {
+            break;
         }
+        residency_batch(pack);
     }
+    return NULL;
+}
 
-    // Reset thread state
-    pthread_mutex_lock(&thread_mutex);
-    for (int i = 0; i < MAX_CONCURRENT_SOUNDS; i++) {
-        thread_active[i] = 0;
+// Only once the mixer no longer plays from the pack, so nothing can ask
+// for one of its sources any more.
+static void stop_residency(SoundPack *pack) {
+    Residency *residency = &pack->residency;
+    if (!residency->running) {
+        return;
     }
-    pthread_mutex_unlock(&thread_mutex);
+    __atomic_store_n(&residency->running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&residency->stop, 1, __ATOMIC_RELAXED);
+    sem_post(&residency->wakeup);
+    pthread_join(residency->thread, NULL);
+    sem_destroy(&residency->wakeup);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2 || argc > 4) {
-        fprintf(stderr, "Usage: %s <config.json> [volume] [verbose]\n", argv[0]);
-        fprintf(stderr, "  volume: 0-100 (default: 50)\n");
-        fprintf(stderr, "  verbose: 1 to enable verbose output (default: 0)\n");
-        return 1;
+// Pin the fallback sounds and queue them with space and enter, the keys
+// hit most, before anything is typed. With prefetch_now they are decoded
+// on this thread before the pack's residency thread starts.
+static int start_residency(SoundPack *pack, int prefetch_now) {
+    for (int i = 0; i < pack->num_generic_press_files; i++) {
+        if (pack->generic_press_sources[i]) {
+            pack->generic_press_sources[i]->pinned = 1;
+            pack->generic_press_sources[i]->requested = 1;
+        }
     }
-
-    // Set volume
-    if (argc >= 3) {
-        int volume_percent = atoi(argv[2]);
-        if (volume_percent < 0) volume_percent = 0;
-        if (volume_percent > 100) volume_percent = 100;
-        g_volume = volume_percent / 100.0f;
-        printf("Volume set to: %d%%\n", volume_percent);
-    } else {
-        printf("Volume set to: 50%% (default)\n");
+    if (pack->release_source) {
+        pack->release_source->pinned = 1;
+        pack->release_source->requested = 1;
     }
-    
-    // Set verbose mode
-    if (argc >= 4) {
-        g_verbose = atoi(argv[3]);
-        if (g_verbose) {
-            printf("Verbose mode enabled\n");
+
+    int prefetch_keys[] = { KEY_SPACE, KEY_ENTER };
+    for (int i = 0; i < (int)(sizeof(prefetch_keys) / sizeof(prefetch_keys[0])); i++) {
+        int key = prefetch_keys[i];
+        SampleSource *sources[] = {
+            pack->is_multi ? pack->multi_key_mappings[key].press_source : pack->key_sources[key],
+            pack->is_multi ? pack->multi_key_mappings[key].release_source : NULL
+        };
+        for (int j = 0; j < 2; j++) {
+            if (sources[j]) sources[j]->requested = 1;
         }
     }
 
-    // Load sound configuration
-    if (load_sound_config(argv[1]) != 0) {
-        fprintf(stderr, "Failed to load sound configuration\n");
-        return 1;
+    Residency *residency = &pack->residency;
+    if (prefetch_now) {
+        residency_batch(pack);
     }
 
-    // Initialize audio
-    if (init_audio() != 0) {
-        fprintf(stderr, "Failed to initialize audio\n");
-        return 1;
+    if (sem_init(&residency->wakeup, 0, prefetch_now ? 0 : 1) != 0) {
+        fprintf(stderr, "Failed to create residency thread\n");
+        return -1;
+    }
+    if (pthread_create(&residency->thread, NULL, residency_thread_main, pack) != 0) {
+        fprintf(stderr, "Failed to create residency thread\n");
+        sem_destroy(&residency->wakeup);
+        return -1;
     }
+    __atomic_store_n(&residency->running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    // printf("Keyboard sound player initialized. Listening for key events...\n");
-    // printf("Max concurrent sounds: %d\n", MAX_CONCURRENT_SOUNDS);
-    // printf("Waiting for input on stdin...\n");
-    // fflush(stdout);
+// Work out every sample the pack references, then decode them in the
+// background so playback never touches the disk. Keys whose sample is not
+// ready yet fall back to a generic sound. With write_cache set, the pack is
+// compiled into the cache once everything is decoded. With wait set, this
+// only returns once the pack can be played without falling back.
+int init_audio(SoundPack *pack, int write_cache, int wait) {
+    // For single mode, check the main sound file. Decoding opens it anyway.
+    if (!pack->is_multi && strlen(pack->sound_file) == 0) {
+        fprintf(stderr, "Error: No sound file specified in config\n");
+        return -1;
+    }
+    if (!pack->is_multi && access(pack->sound_file, R_OK) != 0) {
+        fprintf(stderr, "Error: Cannot read sound file: %s\n", pack->sound_file);
+        return -1;
+    }
 
-    // Add timeout for debugging
-    fd_set readfds;
-    struct timeval timeout;
-    
-    // Read JSON lines from stdin with timeout
-    char line[MAX_LINE_LENGTH];
-    while (1) {
-        FD_ZERO(&readfds);
-        FD_SET(STDIN_FILENO, &readfds);
-        
-        timeout.tv_sec = 1;  // 1 second timeout
-        timeout.tv_usec = 0;
-        
-        int ready = select(STDIN_FILENO + 1, &readfds, NULL, NULL, &timeout);
-        
-        if (ready == -1) {
+    pack->store.sources = calloc(MAX_PACK_SOURCES, sizeof(SampleSource));
+    if (!pack->store.sources) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    pack->store.channels = g_engine_channels;
+    pack->store.samplerate = g_engine_rate;
+
+    // Generic sounds first, they are what everything else falls back to
+    if (pack->is_multi) {
+        for (int i = 0; i < pack->num_generic_press_files; i++) {
+            pack->generic_press_sources[i] = pack_source(pack, pack->generic_press_files[i], 0, 0);
+        }
+        if (strlen(pack->release_file) > 0) {
+            pack->release_source = pack_source(pack, pack->release_file, 0, 0);
+        }
+        for (int i = 0; i < 256; i++) {
+            if (pack->multi_key_mappings[i].press) {
+                pack->multi_key_mappings[i].press_source =
+                    pack_source(pack, pack->multi_key_mappings[i].press, 0, 0);
+            }
+            if (pack->multi_key_mappings[i].release) {
+                pack->multi_key_mappings[i].release_source =
+                    pack_source(pack, pack->multi_key_mappings[i].release, 0, 0);
+            }
+        }
+    } else {
+        for (int i = 0; i < 256; i++) {
+            SoundMapping *mapping = &pack->key_mappings[i];
+            if (mapping->duration_ms <= 0 || mapping->start_ms < 0) {
+                continue;
+            }
+            pack->key_sources[i] = pack_source(pack, pack->sound_file,
+                                                      mapping->start_ms, mapping->duration_ms);
+        }
+    }
+
+    if (pack->store.num_sources == 0) {
+        fprintf(stderr, "Error: No sounds in the pack, nothing to play\n");
+        return -1;
+    }
+
+    // Built here, the workers only ever read it
+    if (resample_table_quality != (int)g_resample_quality) {
+        build_resample_table();
+    }
+
+    if (g_memory_budget > 0) {
+        if (write_cache) {
+            printf("Not compiling the pack cache with a memory budget, use --build-cache\n");
+        }
+        return start_residency(pack, wait);
+    }
+
+    // One pack decodes at a time
+    wait_for_decoding();
+    decode_pack = pack;
+    decode_start_us = monotonic_us();
+    decode_write_cache = write_cache;
+    decode_cache_result = 0;
+    g_conversion = (ConversionStats){0};
+    decode_next = 0;
+    decode_pending = pack->store.num_sources;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int)cores : 1;
+    if (workers > MAX_DECODE_WORKERS) workers = MAX_DECODE_WORKERS;
+    if (workers > pack->store.num_sources) workers = pack->store.num_sources;
+
+    decode_workers = workers;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&decode_threads[i], NULL, decode_worker_main, pack) != 0) {
+            __atomic_store_n(&decode_workers, i > 0 ? i : 1, __ATOMIC_RELAXED);
+            break;
+        }
+        num_decode_threads++;
+    }
+    if (num_decode_threads == 0) {
+        // No threads to spare, decode everything before going on
+        decode_worker_main(pack);
+    }
+    if (wait) {
+        wait_for_decoding();
+    }
+    return 0;
+}
+
+// Compiled packs: the decoded store plus every key's window into it, so a
+// later start can mmap the PCM instead of parsing and decoding anything.
+// Keyed by the config's real path and mtime, the pack directory's mtime
+// (files added or removed) and the engine format and resampling quality.
+// A sound file replaced in place only shows in its own mtime and size,
+// load_pack_cache checks those.
+static int pack_cache_file(const char *config_path, char *real_config, char *out, size_t size) {
+    if (!realpath(config_path, real_config)) {
+        return -1;
+    }
+
+    char pack_dir[PATH_MAX];
+    snprintf(pack_dir, sizeof(pack_dir), "%s", real_config);
+    struct stat config_st, dir_st;
+    if (stat(real_config, &config_st) != 0 || stat(dirname(pack_dir), &dir_st) != 0) {
+        return -1;
+    }
+
+    char key[PATH_MAX + 160];
+    snprintf(key, sizeof(key), "%s|%lld.%09ld|%lld|%lld.%09ld|v%d|s16|%d|%d|%s", real_config,
+             (long long)config_st.st_mtim.tv_sec, config_st.st_mtim.tv_nsec, (long long)config_st.st_size,
+             (long long)dir_st.st_mtim.tv_sec, dir_st.st_mtim.tv_nsec, PACK_CACHE_VERSION,
+             g_engine_rate, g_engine_channels, resample_quality_names[g_resample_quality]);
+
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+
+    if (g_cache_dir) {
+        snprintf(out, size, "%s/%016llx.pack", g_cache_dir, (unsigned long long)hash);
+    } else if (getenv("XDG_CACHE_HOME") && getenv("XDG_CACHE_HOME")[0]) {
+        snprintf(out, size, "%s/mechsim/%016llx.pack", getenv("XDG_CACHE_HOME"), (unsigned long long)hash);
+    } else if (getenv("HOME")) {
+        snprintf(out, size, "%s/.cache/mechsim/%016llx.pack", getenv("HOME"), (unsigned long long)hash);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// A key's source in a cache file, -1 for none
+static int pack_cache_source(int32_t index, SampleSource *sources, uint32_t num_sources,
+                             SampleSource **out) {
+    if (index < -1 || index >= (int64_t)num_sources) {
+        return -1;
+    }
+    *out = index >= 0 ? &sources[index] : NULL;
+    return 0;
+}
+
+static int32_t pack_cache_index(const SoundPack *pack, const SampleSource *source) {
+    return source ? (int32_t)(source - pack->store.sources) : -1;
+}
+
+// Whether the file a cached source was decoded from is still the same.
+// In single mode every source comes from one file, stat it only once.
+static int pack_cache_file_current(const char *mapping, size_t size, const PackCacheSample *cached,
+                                   const char **last_path, int *last_current) {
+    if (cached->path_offset < sizeof(PackCacheHeader) || cached->path_offset >= size) {
+        return 0;
+    }
+    const char *path = mapping + cached->path_offset;
+    if (!memchr(path, '\0', size - cached->path_offset)) {
+        return 0;
+    }
+    if (*last_path && strcmp(*last_path, path) == 0) {
+        return *last_current;
+    }
+
+    struct stat file_st;
+    *last_path = path;
+    *last_current = stat(path, &file_st) == 0 &&
+                    (int64_t)file_st.st_mtim.tv_sec * 1000000000 + file_st.st_mtim.tv_nsec ==
+                        cached->file_mtime_ns &&
+                    file_st.st_size == cached->file_size;
+    if (!*last_current && g_verbose) {
+        printf("%s changed since the pack cache was written\n", path);
+    }
+    return *last_current;
+}
+
+// Map the compiled pack for the config into an empty pack, 0 on a hit
+int load_pack_cache(SoundPack *pack) {
+    if (!pack->cache_file[0]) {
+        return -1;
+    }
+
+    int fd = open(pack->cache_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    // Shared and read-only, so every running player uses the same pages
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    const PackCacheHeader *header = mapping;
+    int valid = memcmp(header->magic, PACK_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == PACK_CACHE_VERSION &&
+                strncmp(header->config_path, pack->real_config, sizeof(header->config_path)) == 0 &&
+                (int)header->channels == g_engine_channels &&
+                (int)header->samplerate == g_engine_rate &&
+                header->num_generic_press <= 5 &&
+                header->num_sources <= MAX_PACK_SOURCES &&
+                header->data_offset % sizeof(short) == 0 &&
+                header->data_offset <= (uint64_t)st.st_size &&
+                header->data_samples <= ((uint64_t)st.st_size - header->data_offset) / sizeof(short);
+
+    SampleSource *sources = valid ? calloc(header->num_sources + 1, sizeof(SampleSource)) : NULL;
+    if (valid && !sources) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+
+    // Any sound file changed in place means decoding the pack again
+    const char *last_path = NULL;
+    int last_current = 0;
+    for (uint32_t i = 0; valid && i < header->num_sources; i++) {
+        if (!pack_cache_file_current(mapping, st.st_size, &header->sources[i], &last_path, &last_current)) {
+            free(sources);
+            munmap(mapping, st.st_size);
+            return -1;
+        }
+    }
+
+    const short *pcm = (const short *)((const char *)mapping + header->data_offset);
+    for (uint32_t i = 0; valid && i < header->num_sources; i++) {
+        const PackCacheSample *cached = &header->sources[i];
+        if (cached->frames == 0) {
+            sources[i].ready = 1;
+            continue;
+        }
+        valid = cached->channels >= 1 && cached->channels <= 8 &&
+                cached->offset <= header->data_samples &&
+                cached->frames <= (header->data_samples - cached->offset) / cached->channels;
+        sources[i].data = (short *)(pcm + cached->offset);
+        sources[i].frames = cached->frames;
+        sources[i].channels = cached->channels;
+        sources[i].source_rate = cached->source_rate;
+        sources[i].ready = 1;
+    }
+
+    for (int i = 0; valid && i < 5; i++) {
+        valid = pack_cache_source(header->generic_press[i], sources, header->num_sources,
+                                  &pack->generic_press_sources[i]) == 0;
+    }
+    valid = valid && pack_cache_source(header->release, sources, header->num_sources, &pack->release_source) == 0;
+    for (int i = 0; valid && i < 256; i++) {
+        if (header->is_multi) {
+            valid = pack_cache_source(header->key_press[i], sources, header->num_sources,
+                                      &pack->multi_key_mappings[i].press_source) == 0 &&
+                    pack_cache_source(header->key_release[i], sources, header->num_sources,
+                                      &pack->multi_key_mappings[i].release_source) == 0;
+        } else {
+            valid = pack_cache_source(header->key_press[i], sources, header->num_sources,
+                                      &pack->key_sources[i]) == 0;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Warning: Ignoring invalid pack cache: %s\n", pack->cache_file);
+        memset(pack->generic_press_sources, 0, sizeof(pack->generic_press_sources));
+        pack->release_source = NULL;
+        memset(pack->multi_key_mappings, 0, sizeof(pack->multi_key_mappings));
+        memset(pack->key_sources, 0, sizeof(pack->key_sources));
+        free(sources);
+        munmap(mapping, st.st_size);
+        return -1;
+    }
+
+    pack->is_multi = header->is_multi;
+    pack->num_generic_press_files = header->num_generic_press;
+    memcpy(pack->name, header->name, sizeof(pack->name));
+    pack->name[sizeof(pack->name) - 1] = '\0';
+
+    pack->store.sources = sources;
+    pack->store.num_sources = header->num_sources;
+    pack->store.channels = header->channels;
+    pack->store.samplerate = header->samplerate;
+    pack->store.mapping = mapping;
+    pack->store.mapping_size = st.st_size;
+    // Read it all in now rather than on the mixer's first touch
+    if (g_lock_memory) {
+        lock_memory(mapping, st.st_size);
+    } else {
+        madvise(mapping, st.st_size, MADV_WILLNEED);
+    }
+
+    printf("Config loaded: Using %s mode\n", pack->is_multi ? "multi" : "single");
+    printf("Mapped %zu KB of cached PCM from %s\n",
+           (size_t)header->data_samples * sizeof(short) / 1024, pack->cache_file);
+    return 0;
+}
+
+static int make_directories(const char *path) {
+    char partial[PATH_MAX];
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *slash = partial + 1; *slash; slash++) {
+        if (*slash == '/') {
+            *slash = '\0';
+            if (mkdir(partial, 0755) != 0 && errno != EEXIST) return -1;
+            *slash = '/';
+        }
+    }
+    return mkdir(partial, 0755) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+static int pwrite_all(int fd, const void *data, size_t length, off_t offset) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// Compile the decoded pack for the next start, once every source is ready.
+// Written to a temporary file and renamed, so a player mapping the old file
+// never sees a partial one.
+int write_pack_cache(const SoundPack *pack) {
+    const char *path = pack->cache_file;
+    if (!path[0]) {
+        fprintf(stderr, "Warning: No pack cache directory, set HOME or --cache-dir\n");
+        return -1;
+    }
+
+    char cache_dir[PATH_MAX + 64];
+    snprintf(cache_dir, sizeof(cache_dir), "%s", path);
+    if (make_directories(dirname(cache_dir)) != 0) {
+        fprintf(stderr, "Warning: Cannot create pack cache directory for %s\n", path);
+        return -1;
+    }
+
+    PackCacheHeader *header = calloc(1, sizeof(PackCacheHeader));
+    if (!header) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    memcpy(header->magic, PACK_CACHE_MAGIC, sizeof(header->magic));
+    header->version = PACK_CACHE_VERSION;
+    header->is_multi = pack->is_multi;
+    header->channels = pack->store.channels;
+    header->samplerate = pack->store.samplerate;
+    header->num_generic_press = pack->num_generic_press_files;
+    header->num_sources = pack->store.num_sources;
+    snprintf(header->config_path, sizeof(header->config_path), "%s", pack->real_config);
+    memcpy(header->name, pack->name, sizeof(header->name));
+
+    // Sources are laid out back to back in the order they were planned,
+    // their paths right after the header
+    uint64_t samples = 0;
+    uint64_t paths_end = sizeof(PackCacheHeader);
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        const SampleSource *source = &pack->store.sources[i];
+        header->sources[i].offset = samples;
+        header->sources[i].frames = source->frames;
+        header->sources[i].channels = source->channels;
+        header->sources[i].source_rate = source->source_rate;
+        header->sources[i].path_offset = paths_end;
+        header->sources[i].file_mtime_ns = source->file_mtime_ns;
+        header->sources[i].file_size = source->file_size;
+        samples += source->frames * source->channels;
+        paths_end += strlen(source->path) + 1;
+    }
+    header->data_samples = samples;
+    header->data_offset = (paths_end + page_size - 1) / page_size * page_size;
+
+    for (int i = 0; i < 5; i++) {
+        header->generic_press[i] = pack_cache_index(pack, pack->generic_press_sources[i]);
+    }
+    header->release = pack_cache_index(pack, pack->release_source);
+    for (int i = 0; i < 256; i++) {
+        if (pack->is_multi) {
+            header->key_press[i] = pack_cache_index(pack, pack->multi_key_mappings[i].press_source);
+            header->key_release[i] = pack_cache_index(pack, pack->multi_key_mappings[i].release_source);
+        } else {
+            header->key_press[i] = pack_cache_index(pack, pack->key_sources[i]);
+            header->key_release[i] = -1;
+        }
+    }
+
+    char temp_path[PATH_MAX + 80];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        fprintf(stderr, "Warning: Cannot write pack cache: %s\n", path);
+        free(header);
+        return -1;
+    }
+    fchmod(fd, 0644);
+
+    int result = pwrite_all(fd, header, sizeof(PackCacheHeader), 0);
+    for (int i = 0; result == 0 && i < pack->store.num_sources; i++) {
+        const char *source_path = pack->store.sources[i].path;
+        result = pwrite_all(fd, source_path, strlen(source_path) + 1, header->sources[i].path_offset);
+    }
+    for (int i = 0; result == 0 && i < pack->store.num_sources; i++) {
+        const SampleSource *source = &pack->store.sources[i];
+        result = pwrite_all(fd, source->data, source->frames * source->channels * sizeof(short),
+                            header->data_offset + header->sources[i].offset * sizeof(short));
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temp_path, path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Warning: Cannot write pack cache: %s\n", path);
+        unlink(temp_path);
+    } else if (g_verbose) {
+        printf("Wrote pack cache: %s\n", path);
+    }
+
+    free(header);
+    return result;
+}
+
+// Free a pack nothing plays from any more. Never called on the mixer thread.
+static void free_sound_pack(SoundPack *pack) {
+    if (!pack) {
+        return;
+    }
+    if (decode_pack == pack) {
+        wait_for_decoding();
+    }
+    stop_residency(pack);
+    __atomic_fetch_sub(&resident_bytes, pack->residency.bytes, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        free(pack->store.sources[i].path);
+        if (pack->store.sources[i].owned) {
+            free(pack->store.sources[i].data);
+        }
+    }
+    free(pack->store.sources);
+    if (pack->store.mapping) {
+        munmap(pack->store.mapping, pack->store.mapping_size);
+    }
+
+    // Free dynamically allocated filenames in multi config
+    for (int i = 0; i < 256; i++) {
+        free(pack->multi_key_mappings[i].press);
+        free(pack->multi_key_mappings[i].release);
+    }
+    free(pack);
+}
+
+// Build the pack for a config, mapped from the cache when it is up to date.
+// See init_audio for wait.
+SoundPack *load_sound_pack(const char *config_path, int wait) {
+    SoundPack *pack = calloc(1, sizeof(SoundPack));
+    if (!pack) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+
+    if (pack_cache_file(config_path, pack->real_config, pack->cache_file, sizeof(pack->cache_file)) != 0) {
+        pack->cache_file[0] = '\0';
+    }
+
+    // A compiled pack skips the config and all decoding
+    if (g_use_cache && load_pack_cache(pack) == 0) {
+        return pack;
+    }
+    if (load_sound_config(pack, config_path) != 0 || init_audio(pack, g_use_cache, wait) != 0) {
+        free_sound_pack(pack);
+        return NULL;
+    }
+    return pack;
+}
+
+// Hot reload: the config's directory is watched with inotify, and SIGHUP
+// asks for a reload too. The new pack is built on the reload thread, then
+// handed to the mixer through g_pending_pack; the mixer hands the old one
+// back through g_retired_pack once no voice plays from it any more.
+// The same thread serves the control socket, so pack switches and reloads
+// never overlap.
+static pthread_t reload_thread;
+static int reload_running = 0;
+static int reload_quit = 0;
+static int reload_pipe[2] = { -1, -1 };
+static int reload_inotify = -1;
+static int reload_watch = -1;
+static char reload_config_path[PATH_MAX];
+static int control_listen = -1;
+static char control_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+void print_stats(FILE *out);
+
+// Safe from a signal handler
+void request_reload() {
+    if (reload_pipe[1] >= 0) {
+        char byte = 'r';
+        ssize_t written = write(reload_pipe[1], &byte, 1);
+        (void)written;   // A full pipe already has a reload queued
+    }
+}
+
+// Watch the directory, editors often replace the file rather than write it
+static int watch_config_dir() {
+    char config_copy[PATH_MAX];
+    snprintf(config_copy, sizeof(config_copy), "%s", reload_config_path);
+    if (reload_watch >= 0) {
+        inotify_rm_watch(reload_inotify, reload_watch);
+    }
+    reload_watch = inotify_add_watch(reload_inotify, dirname(config_copy),
+                                     IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    return reload_watch >= 0 ? 0 : -1;
+}
+
+// Drain pending inotify events, 1 if any of them touched the config
+static int read_config_events() {
+    char config_copy[PATH_MAX];
+    snprintf(config_copy, sizeof(config_copy), "%s", reload_config_path);
+    const char *config_name = basename(config_copy);
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t length;
+    while ((length = read(reload_inotify, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->wd == reload_watch && event->len > 0 && strcmp(event->name, config_name) == 0) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+#ifdef MECHSIM_INPROCESS
+// --device: read these keyboards through evdev instead of libinput
+static char *device_paths[KEY_EVDEV_MAX_DEVICES];
+static int num_device_paths = 0;
+static struct key_evdev evdev_input;
+static int evdev_running = 0;
+
+// Only keys the pack has a sound for are read. Multi mode packs play a
+// generic press for keys they do not map, so those let every key through.
+static void pack_key_filter(const SoundPack *pack, uint8_t *filter) {
+    memset(filter, 0, KEY_FILTER_BYTES);
+    for (int code = 0; code < KEY_FILTER_CODES; code++) {
+        int sounds = pack->is_multi
+            ? pack->multi_key_mappings[code].press_source || pack->multi_key_mappings[code].release_source ||
+              pack->num_generic_press_files > 0 || pack->release_source
+            : pack->key_sources[code] != NULL;
+        if (sounds) {
+            KEY_FILTER_SET(filter, code);
+        }
+    }
+}
+
+static void filter_keys_for_pack(const SoundPack *pack) {
+    if (__atomic_load_n(&evdev_running, __ATOMIC_ACQUIRE)) {
+        uint8_t filter[KEY_FILTER_BYTES];
+        pack_key_filter(pack, filter);
+        key_evdev_set_filter(&evdev_input, filter);
+    }
+}
+#else
+#define filter_keys_for_pack(pack) ((void)0)
+#endif
+
+static int reload_sound_pack(const char *config_path) {
+    uint64_t start_us = monotonic_us();
+    printf("Reloading sound pack: %s\n", config_path);
+
+    SoundPack *pack = load_sound_pack(config_path, 1);
+    if (!pack) {
+        fprintf(stderr, "Reload failed, keeping the current sound pack\n");
+        return -1;
+    }
+    __atomic_store_n(&g_pending_pack, pack, __ATOMIC_RELEASE);
+    wake_mixer();
+    filter_keys_for_pack(pack);
+
+    // Only one switch at a time, so the old pack is the next one handed back
+    while (__atomic_load_n(&g_mixer_running, __ATOMIC_RELAXED)) {
+        SoundPack *retired = __atomic_exchange_n(&g_retired_pack, NULL, __ATOMIC_ACQUIRE);
+        if (retired) {
+            free_sound_pack(retired);
+            break;
+        }
+        if (__atomic_load_n(&reload_quit, __ATOMIC_RELAXED)) {
+            return -1;
+        }
+        usleep(10000);
+    }
+    key_trace_span("reload", start_us, monotonic_us());
+    printf("Reloaded sound pack in %.1f ms\n", (monotonic_us() - start_us) / 1000.0);
+    fflush(stdout);
+    return 0;
+}
+
+// "on", "off" or "toggle" (the default) applied to a flag, -1 if invalid
+static int parse_switch(const char *arg, int current) {
+    if (!arg || strcmp(arg, "toggle") == 0) return !current;
+    if (strcmp(arg, "on") == 0) return 1;
+    if (strcmp(arg, "off") == 0) return 0;
+    return -1;
+}
+
+// Run one control command, writing a single reply that starts with "ok" or "error"
+static void handle_control_command(char *line, FILE *reply) {
+    char *save;
+    char *command = strtok_r(line, " \t\r\n", &save);
+    char *arg = strtok_r(NULL, "\r\n", &save);
+    while (arg && (*arg == ' ' || *arg == '\t')) arg++;
+    if (arg && *arg == '\0') arg = NULL;
+
+    if (!command) {
+        fprintf(reply, "error: empty command\n");
+    } else if (strcmp(command, "volume") == 0) {
+        float volume;
+        __atomic_load(&g_target_volume, &volume, __ATOMIC_RELAXED);
+        long percent = lrintf(volume * 100);
+        if (arg) {
+            char *end;
+            long value = strtol(arg, &end, 10);
+            if (end == arg || *end != '\0') {
+                fprintf(reply, "error: invalid volume: %s\n", arg);
+                return;
+            }
+            // "+5" and "-5" are relative to the current volume
+            percent = (arg[0] == '+' || arg[0] == '-') ? percent + value : value;
+            if (percent < 0) percent = 0;
+            if (percent > 100) percent = 100;
+            volume = percent / 100.0f;
+            __atomic_store(&g_target_volume, &volume, __ATOMIC_RELAXED);
+        }
+        fprintf(reply, "ok volume %ld%%\n", percent);
+    } else if (strcmp(command, "mute") == 0 || strcmp(command, "pause") == 0) {
+        int *flag = command[0] == 'm' ? &g_muted : &g_paused;
+        int value = parse_switch(arg, __atomic_load_n(flag, __ATOMIC_RELAXED));
+        if (value < 0) {
+            fprintf(reply, "error: expected on, off or toggle\n");
+            return;
+        }
+        __atomic_store_n(flag, value, __ATOMIC_RELAXED);
+        fprintf(reply, "ok %s %s\n", command, value ? "on" : "off");
+    } else if (strcmp(command, "pack") == 0 || strcmp(command, "reload") == 0) {
+        const char *config_path = command[0] == 'p' ? arg : reload_config_path;
+        if (!config_path) {
+            fprintf(reply, "error: pack needs a config path\n");
+        } else if (reload_sound_pack(config_path) != 0) {
+            fprintf(reply, "error: cannot load %s, keeping the current sound pack\n", config_path);
+        } else {
+            if (config_path != reload_config_path) {
+                snprintf(reload_config_path, sizeof(reload_config_path), "%s", config_path);
+                if (reload_inotify >= 0 && watch_config_dir() != 0) {
+                    fprintf(stderr, "Warning: Cannot watch %s for changes\n", reload_config_path);
+                }
+            }
+            fprintf(reply, "ok pack %s\n", reload_config_path);
+        }
+    } else if (strcmp(command, "stats") == 0) {
+        float volume;
+        __atomic_load(&g_target_volume, &volume, __ATOMIC_RELAXED);
+        fprintf(reply, "ok pack %s, volume %ld%%, mute %s, pause %s\n", reload_config_path,
+                lrintf(volume * 100), __atomic_load_n(&g_muted, __ATOMIC_RELAXED) ? "on" : "off",
+                __atomic_load_n(&g_paused, __ATOMIC_RELAXED) ? "on" : "off");
+        print_stats(reply);
+    } else if (strcmp(command, "quit") == 0) {
+        fprintf(reply, "ok quit\n");
+        kill(getpid(), SIGTERM);   // the stats thread writes the stats file and exits
+    } else {
+        fprintf(reply, "error: unknown command: %s\n", command);
+    }
+}
+
+// Serve one client: a single command line in, a reply out
+static void serve_control_client() {
+    int fd = accept4(control_listen, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    // A client that never finishes its line must not hold up reloads
+    struct timeval timeout = { .tv_sec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char line[PATH_MAX + 64];
+    size_t length = 0;
+    ssize_t bytes;
+    while (length < sizeof(line) - 1 &&
+           (bytes = read(fd, line + length, sizeof(line) - 1 - length)) > 0) {
+        length += bytes;
+        if (memchr(line, '\n', length)) break;
+    }
+    line[length] = '\0';
+
+    FILE *reply = fdopen(fd, "w");
+    if (!reply) {
+        close(fd);
+        return;
+    }
+    handle_control_command(line, reply);
+    fclose(reply);
+}
+
+static void *reload_thread_main(void *arg) {
+    (void)arg;
+    key_trace_thread("reload");
+    // poll skips the -1 entries of whatever is not enabled
+    struct pollfd fds[3] = {
+        { .fd = reload_pipe[0], .events = POLLIN },
+        { .fd = reload_inotify, .events = POLLIN },
+        { .fd = control_listen, .events = POLLIN }
+    };
+
+    while (!__atomic_load_n(&reload_quit, __ATOMIC_RELAXED)) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        int changed = 0;
+        if (fds[0].revents & POLLIN) {
+            char bytes[16];
+            changed = read(reload_pipe[0], bytes, sizeof(bytes)) > 0;
+        }
+        if ((fds[1].revents & POLLIN) && read_config_events()) {
+            // Editors save in several steps, wait for them to finish
+            while (poll(&fds[1], 1, RELOAD_SETTLE_MS) > 0) {
+                read_config_events();
+            }
+            changed = 1;
+        }
+        if (changed && !__atomic_load_n(&reload_quit, __ATOMIC_RELAXED)) {
+            reload_sound_pack(reload_config_path);
+        }
+        if ((fds[2].revents & POLLIN) && !__atomic_load_n(&reload_quit, __ATOMIC_RELAXED)) {
+            serve_control_client();
+        }
+    }
+    return NULL;
+}
+
+// Listen for control commands on a UNIX socket, before init_reload starts
+// the thread that serves them
+int init_control(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Control socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // Left behind by a player that did not exit cleanly, unless one still answers
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int answered = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (answered) {
+            fprintf(stderr, "Error: Another player already listens on %s\n", socket_path);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if (!bound || listen(fd, 8) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Under sudo the socket still belongs to the user who started mechsim
+    chmod(socket_path, 0600);
+    const char *sudo_uid = getenv("SUDO_UID");
+    const char *sudo_gid = getenv("SUDO_GID");
+    if (sudo_uid && sudo_gid && chown(socket_path, atoi(sudo_uid), atoi(sudo_gid)) != 0) {
+        perror("chown");
+    }
+
+    // A client that hangs up before its reply must not take the player down
+    signal(SIGPIPE, SIG_IGN);
+    control_listen = fd;
+    snprintf(control_path, sizeof(control_path), "%s", socket_path);
+    printf("Control socket: %s\n", socket_path);
+    return 0;
+}
+
+int init_reload(const char *config_path) {
+    if (!realpath(config_path, reload_config_path)) {
+        snprintf(reload_config_path, sizeof(reload_config_path), "%s", config_path);
+    }
+    if (pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        perror("pipe2");
+        return -1;
+    }
+
+    reload_inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (reload_inotify < 0 || watch_config_dir() != 0) {
+        fprintf(stderr, "Warning: Cannot watch %s for changes, reload with SIGHUP\n", config_path);
+        if (reload_inotify >= 0) close(reload_inotify);
+        reload_inotify = -1;
+    }
+
+    if (pthread_create(&reload_thread, NULL, reload_thread_main, NULL) != 0) {
+        fprintf(stderr, "Failed to create reload thread\n");
+        return -1;
+    }
+    reload_running = 1;
+    return 0;
+}
+
+// Also called on the way out from the stats thread
+void remove_control_socket() {
+    if (control_path[0]) {
+        unlink(control_path);
+    }
+}
+
+static void stop_reload() {
+    if (!reload_running) {
+        return;
+    }
+    __atomic_store_n(&reload_quit, 1, __ATOMIC_RELAXED);
+    char byte = 'q';
+    ssize_t written = write(reload_pipe[1], &byte, 1);
+    (void)written;
+    pthread_join(reload_thread, NULL);
+    reload_running = 0;
+
+    if (control_listen >= 0) {
+        close(control_listen);
+        control_listen = -1;
+        remove_control_socket();
+    }
+}
+
+static int source_ready(const SampleSource *source) {
+    return source && __atomic_load_n(&source->ready, __ATOMIC_ACQUIRE);
+}
+
+// Mixer thread: hold a decoded, non-empty source for a voice, so it cannot
+// be evicted while it plays. Counting before looking at ready pairs with
+// evict_source, which clears ready before looking at the count.
+static int source_acquire(SampleSource *source) {
+    if (!source) {
+        return 0;
+    }
+    __atomic_fetch_add(&source->playing, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&source->ready, __ATOMIC_SEQ_CST) && source->frames > 0) {
+        __atomic_store_n(&source->last_used, __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        return 1;
+    }
+    __atomic_fetch_sub(&source->playing, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static void source_release(SampleSource *source) {
+    __atomic_fetch_sub(&source->playing, 1, __ATOMIC_RELEASE);
+}
+
+// Mixer thread: verbose messages take the stdio lock and write(2), which a
+// SCHED_FIFO mixer must not wait on, so it leaves them to the stats then
+static int mixer_verbose() {
+    return g_verbose && g_realtime_priority == 0;
+}
+
+// Mixer thread: xorshift32 for picking generic presses, rand() takes a lock.
+// Seeded when the mixer starts, never 0.
+static uint32_t mixer_random_state = 1;
+
+static uint32_t mixer_random() {
+    uint32_t x = mixer_random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return mixer_random_state = x;
+}
+
+// A decoded generic press, starting from a random one
+static SampleSource *acquire_generic_press(SoundPack *pack) {
+    int count = pack->num_generic_press_files;
+    if (count == 0) {
+        return NULL;
+    }
+    int first = (int)(mixer_random() % (uint32_t)count);
+    for (int i = 0; i < count; i++) {
+        SampleSource *source = pack->generic_press_sources[(first + i) % count];
+        if (source_acquire(source)) {
+            return source;
+        }
+    }
+    return NULL;
+}
+
+// Pick the decoded sample for a key event, or NULL if nothing should play.
+// The sample comes back acquired, the voice playing it releases it. Keys
+// whose own sample is not decoded yet, or was evicted, play a generic
+// sound instead and ask for theirs.
+static SampleSource *resolve_sample(SoundPack *pack, int key_code, int is_pressed) {
+    if (key_code < 0 || key_code >= 256) {
+        return NULL;
+    }
+
+    SampleSource *sample = NULL;
+    SampleSource *wanted = NULL;
+    if (pack->is_multi) {
+        wanted = is_pressed ? pack->multi_key_mappings[key_code].press_source
+                            : pack->multi_key_mappings[key_code].release_source;
+        // First try exact match
+        if (source_acquire(wanted)) {
+            sample = wanted;
+        } else if (is_pressed) {
+            // Fallback: random generic press
+            sample = acquire_generic_press(pack);
+        } else if (source_acquire(pack->release_source)) {
+            sample = pack->release_source;
+        }
+    } else {
+        wanted = pack->key_sources[key_code];
+        if (source_acquire(wanted)) {
+            sample = wanted;
+        } else if (wanted && !source_ready(wanted)) {
+            // Any segment that is ready beats silence
+            for (int i = 0; i < pack->store.num_sources && !sample; i++) {
+                if (source_acquire(&pack->store.sources[i])) {
+                    sample = &pack->store.sources[i];
+                }
+            }
+        }
+    }
+
+    if (wanted && !source_ready(wanted)) {
+        source_request(pack, wanted);
+        if (mixer_verbose() && sample) {
+            printf("Key %d not decoded yet, playing a fallback sound\n", key_code);
+        }
+    }
+    return sample;
+}
+
+static int latency_bucket(uint64_t us) {
+    if (us < 16) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int index = 16 + (msb - 4) * 8 + (int)((us >> (msb - 3)) & 7);
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Largest latency that lands in a bucket
+static uint64_t latency_bucket_limit(int index) {
+    if (index < 16) return (uint64_t)index;
+    int msb = (index - 16) / 8 + 4;
+    uint64_t sub = (uint64_t)((index - 16) % 8);
+    return ((8 + sub + 1) << (msb - 3)) - 1;
+}
+
+static void record_latency(LatencyStage stage, uint64_t from_us, uint64_t to_us) {
+    if (from_us == 0 || to_us < from_us) {
+        return;   // Unknown or from a clock we cannot compare against
+    }
+
+    LatencyHistogram *histogram = &g_stats.latency[stage];
+    uint64_t us = to_us - from_us;
+    __atomic_fetch_add(&histogram->counts[latency_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_us, us, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&histogram->max_us, &max, us, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t latency_percentile(const LatencyHistogram *histogram, uint64_t samples, int percent) {
+    uint64_t max = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    uint64_t wanted = (samples * percent + 99) / 100, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        if (seen >= wanted) {
+            uint64_t limit = latency_bucket_limit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+static uint64_t process_cpu_us() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Start counting CPU and allocations from here, loading the pack is not interesting
+void mark_stats_ready() {
+    g_stats.ready_cpu_us = process_cpu_us();
+    if (mechsim_alloc_count) {
+        g_stats.ready_allocs = mechsim_alloc_count();
+    }
+}
+
+void print_stats(FILE *out) {
+    fprintf(out, "MechSim player stats\n");
+    fprintf(out, "  events: %llu, voices started: %llu, active voices: %d (peak %d)\n",
+            (unsigned long long)__atomic_load_n(&g_stats.events, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&g_stats.voices_started, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_active_voices, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_stats.peak_voices, __ATOMIC_RELAXED));
+    fprintf(out, "  dropped: %lu (queue full), %lu (no voice), %lu (rate limit), stolen: %lu, cut: %lu, underruns: %llu\n",
+            __atomic_load_n(&g_events.overflows, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_voices_dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_events_throttled, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_voices_stolen, __ATOMIC_RELAXED),
+            __atomic_load_n(&g_voices_cut, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&g_stats.underruns, __ATOMIC_RELAXED));
+    if (g_stats.ready_cpu_us) {
+        fprintf(out, "  cpu: %.3f ms", (process_cpu_us() - g_stats.ready_cpu_us) / 1000.0);
+        if (mechsim_alloc_count) {
+            fprintf(out, ", allocations: %lu", mechsim_alloc_count() - g_stats.ready_allocs);
+        }
+        fprintf(out, " (since input started)\n");
+    }
+    if (g_idle_ms > 0) {
+        uint64_t idle_us = __atomic_load_n(&g_stats.idle_us, __ATOMIC_RELAXED);
+        uint64_t since_us = __atomic_load_n(&g_stats.idle_since_us, __ATOMIC_RELAXED);
+        if (since_us) {
+            idle_us += monotonic_us() - since_us;
+        }
+        fprintf(out, "  idle: %llu times, %.1f s stopped%s\n",
+                (unsigned long long)__atomic_load_n(&g_stats.idle_count, __ATOMIC_RELAXED),
+                idle_us / 1e6, since_us ? " (stopped now)" : "");
+    }
+    if (g_memory_budget > 0) {
+        fprintf(out, "  resident: %zu KB of %zu KB budget, decodes: %lu, evictions: %lu\n",
+                __atomic_load_n(&resident_bytes, __ATOMIC_RELAXED) / 1024, g_memory_budget / 1024,
+                __atomic_load_n(&residency_decodes, __ATOMIC_RELAXED),
+                __atomic_load_n(&residency_evictions, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "  latency (us)  %8s %8s %8s %8s %8s\n", "count", "mean", "p50", "p99", "max");
+
+    for (int stage = 0; stage < NUM_LATENCY_STAGES; stage++) {
+        const LatencyHistogram *histogram = &g_stats.latency[stage];
+        uint64_t samples = __atomic_load_n(&histogram->samples, __ATOMIC_RELAXED);
+        if (samples == 0) {
+            fprintf(out, "  %-12s  %8d %8s %8s %8s %8s\n", latency_stage_names[stage], 0, "-", "-", "-", "-");
+            continue;
+        }
+        fprintf(out, "  %-12s  %8llu %8llu %8llu %8llu %8llu\n", latency_stage_names[stage],
+                (unsigned long long)samples,
+                (unsigned long long)(__atomic_load_n(&histogram->sum_us, __ATOMIC_RELAXED) / samples),
+                (unsigned long long)latency_percentile(histogram, samples, 50),
+                (unsigned long long)latency_percentile(histogram, samples, 99),
+                (unsigned long long)__atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED));
+    }
+    fflush(out);
+}
+
+void write_stats_file() {
+    if (!g_stats_path) {
+        return;
+    }
+
+    FILE *file = fopen(g_stats_path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write stats file: %s\n", g_stats_path);
+        perror("fopen");
+        return;
+    }
+    print_stats(file);
+    fclose(file);
+}
+
+// SIGUSR1 dumps stats, SIGHUP reloads the sound pack, SIGINT/SIGTERM write
+// the stats file and exit.
+// The signals are blocked everywhere else so only this thread sees them.
+void* stats_thread_main(void* arg) {
+    sigset_t *signals = arg;
+    int sig;
+
+    while (sigwait(signals, &sig) == 0) {
+        if (sig == SIGUSR1) {
+            print_stats(stderr);
+            continue;
+        }
+        if (sig == SIGHUP) {
+            request_reload();
+            continue;
+        }
+        write_stats_file();
+        remove_control_socket();
+        exit(0);
+    }
+    return NULL;
+}
+
+int init_stats_thread() {
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    // Threads created after this inherit the mask
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        fprintf(stderr, "Failed to block stats signals\n");
+        return -1;
+    }
+
+    pthread_t stats_thread;
+    if (pthread_create(&stats_thread, NULL, stats_thread_main, &signals) != 0) {
+        fprintf(stderr, "Failed to create stats thread\n");
+        return -1;
+    }
+    pthread_detach(stats_thread);
+    return 0;
+}
+
+// Producer side: never blocks, counts the event if the ring is full
+static int event_queue_push(EventQueue *queue, const TriggerEvent *event) {
+    unsigned head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= EVENT_QUEUE_SIZE) {
+        __atomic_store_n(&queue->overflows, queue->overflows + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    queue->events[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Consumer side: returns 0 when the ring is empty
+static int event_queue_pop(EventQueue *queue, TriggerEvent *event) {
+    unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    unsigned head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        return 0;
+    }
+
+    *event = queue->events[tail & (EVENT_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int event_queue_empty(const EventQueue *queue) {
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+}
+
+// Mixer thread: let a voice fade out over fade_ms instead of cutting it
+static void fade_out_voice(Voice *voice, int fade_ms) {
+    int fade = (int)(g_output_spec.rate * fade_ms / 1000);
+    voice->fade_frames = voice->fade_total = fade > 0 ? fade : 1;
+}
+
+// Mixer thread: --max-event-rate as a token bucket refilled by mixed
+// frames, in events times the output rate so it stays in integers
+static int64_t throttle_tokens = -1;   // full until the first refill
+
+static void throttle_refill() {
+    if (g_max_event_rate == 0) {
+        return;
+    }
+    int64_t burst = (int64_t)g_max_event_rate * THROTTLE_BURST_MS / 1000;
+    int64_t capacity = (burst > 1 ? burst : 1) * g_output_spec.rate;
+    throttle_tokens = throttle_tokens < 0 ? capacity
+                    : throttle_tokens + (int64_t)g_max_event_rate * MIX_PERIOD_FRAMES;
+    if (throttle_tokens > capacity) throttle_tokens = capacity;
+}
+
+static int throttle_take() {
+    if (g_max_event_rate == 0) {
+        return 1;
+    }
+    if (throttle_tokens < (int64_t)g_output_spec.rate) {
+        return 0;
+    }
+    throttle_tokens -= g_output_spec.rate;
+    return 1;
+}
+
+// Mixer thread: apply the key's retrigger policy to its playing voices
+// before the key starts a new one
+static void retrigger_key(int key_code, int is_pressed) {
+    RetriggerPolicy policy = key_code < 256 ? g_key_retrigger[key_code] : g_retrigger_policy;
+
+    if (policy == RETRIGGER_RELEASE && !is_pressed) {
+        for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+            Voice *voice = &g_voices[i];
+            if (voice->active && voice->fade_frames == 0 && voice->key_code == key_code && voice->pressed) {
+                fade_out_voice(voice, RELEASE_FADE_MS);
+                __atomic_store_n(&g_voices_cut, g_voices_cut + 1, __ATOMIC_RELAXED);
+            }
+        }
+        return;
+    }
+    if (!is_pressed || (policy != RETRIGGER_CUT && policy != RETRIGGER_CAP)) {
+        return;
+    }
+
+    // Fade the key's oldest voices until the new one fits under the limit
+    int limit = policy == RETRIGGER_CUT ? 1 : g_key_voice_cap;
+    for (;;) {
+        Voice *oldest = NULL;
+        int count = 0;
+        for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+            Voice *voice = &g_voices[i];
+            if (voice->active && voice->fade_frames == 0 && voice->key_code == key_code) {
+                count++;
+                if (!oldest || voice->started < oldest->started) oldest = voice;
+            }
+        }
+        if (count < limit) {
+            break;
+        }
+        fade_out_voice(oldest, STEAL_FADE_MS);
+        __atomic_store_n(&g_voices_cut, g_voices_cut + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Pick a playing voice to make room for a new one, or NULL to drop it
+static Voice *choose_victim(int key_code) {
+    Voice *victim = NULL;
+
+    for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+        Voice *voice = &g_voices[i];
+        if (!voice->active || voice->fade_frames > 0) {
+            continue;
+        }
+
+        switch (g_steal_policy) {
+        case STEAL_NONE:
+            return NULL;
+        case STEAL_RETRIGGER:
+            if (voice->key_code == key_code) {
+                return voice;
+            }
+            // Otherwise steal the oldest voice
+            // fall through
+        case STEAL_OLDEST:
+            if (!victim || voice->started < victim->started) victim = voice;
+            break;
+        case STEAL_QUIETEST:
+            if (!victim || voice->peak < victim->peak) victim = voice;
+            break;
+        }
+    }
+
+    return victim;
+}
+
+// Mixer thread: turn a trigger into a voice, returns 0 if one started
+static int start_voice(const TriggerEvent *event, int offset) {
+    int key_code = event->key_code;
+    int is_pressed = event->is_pressed;
+
+    // A release can cut its press short even when it has no sound of its own
+    if (!is_pressed) {
+        retrigger_key(key_code, is_pressed);
+    }
+
+    // Only play sound on key press in single mode
+    if (!g_sound_pack->is_multi && !is_pressed) {
+        if (mixer_verbose()) {
+            printf("Single mode: Ignoring key release for key %d\n", key_code);
+        }
+        return -1;
+    }
+
+    SampleSource *sample = resolve_sample(g_sound_pack, key_code, is_pressed);
+    if (!sample) {
+        if (mixer_verbose()) {
+            printf("No sound mapped for key %d (%s)\n", key_code, is_pressed ? "press" : "release");
+        }
+        return -1;
+    }
+
+    if (!throttle_take()) {
+        source_release(sample);
+        __atomic_store_n(&g_events_throttled, g_events_throttled + 1, __ATOMIC_RELAXED);
+        if (mixer_verbose()) {
+            printf("Warning: Over the event rate limit, dropped key %d\n", key_code);
+        }
+        return -1;
+    }
+
+    if (is_pressed) {
+        retrigger_key(key_code, is_pressed);
+    }
+
+    int slot = -1;
+    int playing = 0;
+    for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+        if (!g_voices[i].active) {
+            if (slot == -1) slot = i;
+        } else if (g_voices[i].fade_frames == 0) {
+            playing++;
+        }
+    }
+
+    if (playing >= g_voice_pool_size) {
+        Voice *victim = choose_victim(key_code);
+        if (!victim) {
+            source_release(sample);
+            __atomic_store_n(&g_voices_dropped, g_voices_dropped + 1, __ATOMIC_RELAXED);
+            if (mixer_verbose()) {
+                printf("Warning: No free voices, dropped key %d\n", key_code);
+            }
+            return -1;
+        }
+
+        // Fade the stolen voice out in a spare slot instead of cutting it
+        fade_out_voice(victim, STEAL_FADE_MS);
+        __atomic_store_n(&g_voices_stolen, g_voices_stolen + 1, __ATOMIC_RELAXED);
+    }
+
+    if (slot == -1) {
+        // Every spare slot is still fading, cut the one closest to silence
+        for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+            if (g_voices[i].fade_frames > 0 &&
+                (slot == -1 || g_voices[i].fade_frames < g_voices[slot].fade_frames)) {
+                slot = i;
+            }
+        }
+        if (slot == -1) {
+            source_release(sample);
+            return -1;
+        }
+    }
+
+    Voice *voice = &g_voices[slot];
+    if (voice->active) {
+        source_release(voice->sample);
+    }
+    voice->sample = sample;
+    voice->pack = g_sound_pack;
+    voice->position = 0;
+    voice->started = g_mixer_frame + offset;
+    voice->offset = offset;
+    voice->fade_frames = voice->fade_total = 0;
+    voice->peak = 0;
+    voice->key_code = key_code;
+    voice->pressed = is_pressed;
+    voice->active = 1;
+
+    if (mixer_verbose()) {
+        printf("Voice %d: Playing sound for key %d (%s)\n",
+               slot, key_code, is_pressed ? "press" : "release");
+    }
+    __atomic_fetch_add(&g_stats.voices_started, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline int peak_of(int max, int min) {
+    return max > -min ? max : -min;
+}
+
+static int mix_add_scalar(int32_t *acc, const short *src, size_t samples) {
+    int max = 0, min = 0;
+    for (size_t i = 0; i < samples; i++) {
+        acc[i] += src[i];
+        if (src[i] > max) max = src[i];
+        if (src[i] < min) min = src[i];
+    }
+    return peak_of(max, min);
+}
+
+static int mix_add_mono_to_stereo_scalar(int32_t *acc, const short *src, size_t frames) {
+    int max = 0, min = 0;
+    for (size_t i = 0; i < frames; i++) {
+        acc[2 * i] += src[i];
+        acc[2 * i + 1] += src[i];
+        if (src[i] > max) max = src[i];
+        if (src[i] < min) min = src[i];
+    }
+    return peak_of(max, min);
+}
+
+static void gain_saturate_scalar(short *out, const int32_t *acc, size_t samples, float gain) {
+    for (size_t i = 0; i < samples; i++) {
+        long value = lrintf((float)acc[i] * gain);
+        if (value > 32767) value = 32767;
+        if (value < -32768) value = -32768;
+        out[i] = (short)value;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline int peak_of_sse2(__m128i vmax, __m128i vmin) {
+    short maxs[8], mins[8];
+    _mm_storeu_si128((__m128i *)maxs, vmax);
+    _mm_storeu_si128((__m128i *)mins, vmin);
+    int max = 0, min = 0;
+    for (int i = 0; i < 8; i++) {
+        if (maxs[i] > max) max = maxs[i];
+        if (mins[i] < min) min = mins[i];
+    }
+    return peak_of(max, min);
+}
+
+__attribute__((target("sse2")))
+static int mix_add_sse2(int32_t *acc, const short *src, size_t samples) {
+    __m128i vmax = _mm_setzero_si128(), vmin = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        vmax = _mm_max_epi16(vmax, s);
+        vmin = _mm_min_epi16(vmin, s);
+        // Sign-extend to 32 bits by unpacking into the high half and shifting down
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+        _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(a0, lo));
+        _mm_storeu_si128((__m128i *)(acc + i + 4), _mm_add_epi32(a1, hi));
+    }
+    int peak = peak_of_sse2(vmax, vmin);
+    int tail = mix_add_scalar(acc + i, src + i, samples - i);
+    return peak > tail ? peak : tail;
+}
+
+__attribute__((target("sse2")))
+static int mix_add_mono_to_stereo_sse2(int32_t *acc, const short *src, size_t frames) {
+    __m128i vmax = _mm_setzero_si128(), vmin = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        vmax = _mm_max_epi16(vmax, s);
+        vmin = _mm_min_epi16(vmin, s);
+        __m128i d0 = _mm_unpacklo_epi16(s, s);   // s0 s0 s1 s1 s2 s2 s3 s3
+        __m128i d1 = _mm_unpackhi_epi16(s, s);   // s4 s4 ... s7 s7
+        __m128i parts[4] = {
+            _mm_srai_epi32(_mm_unpacklo_epi16(d0, d0), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(d0, d0), 16),
+            _mm_srai_epi32(_mm_unpacklo_epi16(d1, d1), 16),
+            _mm_srai_epi32(_mm_unpackhi_epi16(d1, d1), 16)
+        };
+        for (int p = 0; p < 4; p++) {
+            __m128i *dst = (__m128i *)(acc + 2 * i + 4 * p);
+            _mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), parts[p]));
+        }
+    }
+    int peak = peak_of_sse2(vmax, vmin);
+    int tail = mix_add_mono_to_stereo_scalar(acc + 2 * i, src + i, frames - i);
+    return peak > tail ? peak : tail;
+}
+
+__attribute__((target("sse2")))
+static void gain_saturate_sse2(short *out, const int32_t *acc, size_t samples, float gain) {
+    // cvtps2dq rounds to nearest like lrintf, packs saturates like the clamp
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128 f0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(acc + i))), g);
+        __m128 f1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(acc + i + 4))), g);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(f0), _mm_cvtps_epi32(f1));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+    gain_saturate_scalar(out + i, acc + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static int mix_add_avx2(int32_t *acc, const short *src, size_t samples) {
+    __m128i vmax = _mm_setzero_si128(), vmin = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        vmax = _mm_max_epi16(vmax, s);
+        vmin = _mm_min_epi16(vmin, s);
+        __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+        _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(a, _mm256_cvtepi16_epi32(s)));
+    }
+    int peak = peak_of_sse2(vmax, vmin);
+    int tail = mix_add_scalar(acc + i, src + i, samples - i);
+    return peak > tail ? peak : tail;
+}
+
+__attribute__((target("avx2")))
+static int mix_add_mono_to_stereo_avx2(int32_t *acc, const short *src, size_t frames) {
+    const __m256i dup_lo = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i dup_hi = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+    __m128i vmax = _mm_setzero_si128(), vmin = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        vmax = _mm_max_epi16(vmax, s);
+        vmin = _mm_min_epi16(vmin, s);
+        __m256i wide = _mm256_cvtepi16_epi32(s);
+        __m256i *dst = (__m256i *)(acc + 2 * i);
+        _mm256_storeu_si256(dst, _mm256_add_epi32(_mm256_loadu_si256(dst),
+                                                  _mm256_permutevar8x32_epi32(wide, dup_lo)));
+        _mm256_storeu_si256(dst + 1, _mm256_add_epi32(_mm256_loadu_si256(dst + 1),
+                                                      _mm256_permutevar8x32_epi32(wide, dup_hi)));
+    }
+    int peak = peak_of_sse2(vmax, vmin);
+    int tail = mix_add_mono_to_stereo_scalar(acc + 2 * i, src + i, frames - i);
+    return peak > tail ? peak : tail;
+}
+
+__attribute__((target("avx2")))
+static void gain_saturate_avx2(short *out, const int32_t *acc, size_t samples, float gain) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(acc + i))), g);
+        __m256i r = _mm256_cvtps_epi32(f);
+        // packs works within 128-bit lanes, so pack the two halves directly
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+    gain_saturate_scalar(out + i, acc + i, samples - i, gain);
+}
+#endif
+
+static const MixKernels mix_kernel_table[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", mix_add_avx2, mix_add_mono_to_stereo_avx2, gain_saturate_avx2 },
+    { "sse2", mix_add_sse2, mix_add_mono_to_stereo_sse2, gain_saturate_sse2 },
+#endif
+    { "scalar", mix_add_scalar, mix_add_mono_to_stereo_scalar, gain_saturate_scalar },
+};
+
+static int cpu_supports_kernel(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+// Pick the fastest supported kernels, or the requested ones ("auto" or NULL for fastest)
+int select_mix_kernels(const char *requested) {
+    int count = (int)(sizeof(mix_kernel_table) / sizeof(mix_kernel_table[0]));
+    for (int i = 0; i < count; i++) {
+        const MixKernels *kernels = &mix_kernel_table[i];
+        if (requested && strcmp(requested, "auto") != 0 && strcmp(requested, kernels->name) != 0) {
+            continue;
+        }
+        if (cpu_supports_kernel(kernels->name)) {
+            g_mix_kernels = kernels;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Mix kernel not supported on this CPU: %s\n", requested);
+    return -1;
+}
+
+// Add one voice's next frames into the mix accumulator
+static void mix_voice(Voice *voice, int32_t *mix, int frames, int out_channels) {
+    // A scheduled voice starts part way into its first period
+    if (voice->offset > 0) {
+        mix += voice->offset * out_channels;
+        frames -= voice->offset;
+        voice->offset = 0;
+    }
+
+    SampleSource *sample = voice->sample;
+    const short *pcm = sample->data + voice->position * sample->channels;
+    int in_channels = sample->channels;
+
+    size_t remaining = sample->frames - voice->position;
+    if ((size_t)frames > remaining) frames = (int)remaining;
+    if (voice->fade_frames > 0 && frames > voice->fade_frames) frames = voice->fade_frames;
+
+    int peak = 0;
+    if (voice->fade_frames == 0 && in_channels == out_channels) {
+        peak = g_mix_kernels->add(mix, pcm, (size_t)frames * out_channels);
+    } else if (voice->fade_frames == 0 && in_channels == 1 && out_channels == 2) {
+        peak = g_mix_kernels->add_mono_to_stereo(mix, pcm, frames);
+    } else {
+        // Fading voices and unusual layouts take the slow path
+        for (int f = 0; f < frames; f++) {
+            const short *frame = pcm + f * in_channels;
+            for (int c = 0; c < out_channels; c++) {
+                // Mono samples are copied to every output channel
+                int value = frame[c < in_channels ? c : in_channels - 1];
+                if (voice->fade_frames > 0) {
+                    value = value * (voice->fade_frames - f) / voice->fade_total;
+                }
+                mix[f * out_channels + c] += value;
+                if (value > peak) peak = value;
+                else if (-value > peak) peak = -value;
+            }
+        }
+    }
+
+    voice->peak = peak;
+    voice->position += frames;
+    int finished = voice->position >= sample->frames;
+    if (voice->fade_frames > 0) {
+        voice->fade_frames -= frames;
+        finished = finished || voice->fade_frames == 0;
+    }
+    if (finished) {
+        voice->active = 0;
+        voice->fade_frames = 0;
+        source_release(sample);
+    }
+}
+
+// PulseAudio, target is a sink name. The stream runs on its own threaded
+// mainloop so its buffer can be sized exactly: tlength is the whole
+// latency we ask for, and the server asks for more one mixer period at a time.
+static pa_threaded_mainloop *pulse_mainloop = NULL;
+static pa_context *pulse_context = NULL;
+static pa_stream *pulse_stream = NULL;
+
+// Mainloop thread: wake whoever waits in pulse_open, pulse_write or pulse_close
+static void pulse_context_state(pa_context *context, void *userdata) {
+    (void)context;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_state(pa_stream *stream, void *userdata) {
+    (void)stream;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_writable(pa_stream *stream, size_t bytes, void *userdata) {
+    (void)stream;
+    (void)bytes;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+static void pulse_stream_done(pa_stream *stream, int success, void *userdata) {
+    (void)stream;
+    (void)success;
+    (void)userdata;
+    pa_threaded_mainloop_signal(pulse_mainloop, 0);
+}
+
+// Called with the mainloop locked
+static void pulse_wait(pa_operation *operation) {
+    while (operation && pa_operation_get_state(operation) == PA_OPERATION_RUNNING) {
+        pa_threaded_mainloop_wait(pulse_mainloop);
+    }
+    if (operation) {
+        pa_operation_unref(operation);
+    }
+}
+
+// The server played everything it had and is waiting for the mixer
+static void pulse_stream_underflow(pa_stream *stream, void *userdata) {
+    (void)stream;
+    (void)userdata;
+    __atomic_fetch_add(&g_stats.underruns, 1, __ATOMIC_RELAXED);
+}
+
+static void pulse_close(int drain) {
+    if (!pulse_mainloop) {
+        return;
+    }
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    if (pulse_stream) {
+        if (drain && pa_stream_get_state(pulse_stream) == PA_STREAM_READY) {
+            pulse_wait(pa_stream_drain(pulse_stream, pulse_stream_done, NULL));
+        }
+        pa_stream_disconnect(pulse_stream);
+        pa_stream_unref(pulse_stream);
+        pulse_stream = NULL;
+    }
+    if (pulse_context) {
+        pa_context_disconnect(pulse_context);
+        pa_context_unref(pulse_context);
+        pulse_context = NULL;
+    }
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+
+    pa_threaded_mainloop_stop(pulse_mainloop);
+    pa_threaded_mainloop_free(pulse_mainloop);
+    pulse_mainloop = NULL;
+}
+
+// Called with the mainloop locked, once the context is connecting
+static int pulse_connect_stream(const char *target) {
+    if (pa_threaded_mainloop_start(pulse_mainloop) < 0) {
+        fprintf(stderr, "Could not initialize PulseAudio: Cannot start mainloop\n");
+        return -1;
+    }
+
+    pa_context_state_t context_state;
+    while ((context_state = pa_context_get_state(pulse_context)) != PA_CONTEXT_READY) {
+        if (!PA_CONTEXT_IS_GOOD(context_state)) {
+            fprintf(stderr, "Could not initialize PulseAudio: %s\n",
+                    pa_strerror(pa_context_errno(pulse_context)));
+            return -1;
+        }
+        pa_threaded_mainloop_wait(pulse_mainloop);
+    }
+
+    pulse_stream = pa_stream_new(pulse_context, "playback", &g_output_spec, NULL);
+    if (!pulse_stream) {
+        fprintf(stderr, "Could not create PulseAudio stream: %s\n",
+                pa_strerror(pa_context_errno(pulse_context)));
+        return -1;
+    }
+    pa_stream_set_state_callback(pulse_stream, pulse_stream_state, NULL);
+    pa_stream_set_write_callback(pulse_stream, pulse_stream_writable, NULL);
+    pa_stream_set_underflow_callback(pulse_stream, pulse_stream_underflow, NULL);
+
+    // Ask for more one period at a time and start playing as soon as the
+    // first period is in, also after an underflow. With ADJUST_LATENCY the
+    // server sizes the sink buffer so tlength is the whole output latency.
+    uint32_t period_bytes = MIX_PERIOD_FRAMES * pa_frame_size(&g_output_spec);
+    uint32_t target_bytes = pa_usec_to_bytes((pa_usec_t)g_output_latency_ms * 1000, &g_output_spec);
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t)-1,
+        .tlength = target_bytes > 2 * period_bytes ? target_bytes : 2 * period_bytes,
+        .prebuf = period_bytes,
+        .minreq = period_bytes,
+        .fragsize = (uint32_t)-1
+    };
+    pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+                              PA_STREAM_AUTO_TIMING_UPDATE;
+    if (pa_stream_connect_playback(pulse_stream, target, &attr, flags, NULL, NULL) < 0) {
+        fprintf(stderr, "Could not connect PulseAudio stream: %s\n",
+                pa_strerror(pa_context_errno(pulse_context)));
+        return -1;
+    }
+
+    pa_stream_state_t stream_state;
+    while ((stream_state = pa_stream_get_state(pulse_stream)) != PA_STREAM_READY) {
+        if (!PA_STREAM_IS_GOOD(stream_state)) {
+            fprintf(stderr, "Could not connect PulseAudio stream: %s\n",
+                    pa_strerror(pa_context_errno(pulse_context)));
+            return -1;
+        }
+        pa_threaded_mainloop_wait(pulse_mainloop);
+    }
+
+    // The server may round what we asked for
+    const pa_buffer_attr *granted = pa_stream_get_buffer_attr(pulse_stream);
+    if (granted) {
+        printf("PulseAudio buffer: target %.1f ms, request %.1f ms, prebuffer %.1f ms\n",
+               pa_bytes_to_usec(granted->tlength, &g_output_spec) / 1000.0,
+               pa_bytes_to_usec(granted->minreq, &g_output_spec) / 1000.0,
+               pa_bytes_to_usec(granted->prebuf, &g_output_spec) / 1000.0);
+    }
+    return 0;
+}
+
+static int pulse_open(const char *target) {
+    pulse_mainloop = pa_threaded_mainloop_new();
+    if (!pulse_mainloop) {
+        fprintf(stderr, "Could not initialize PulseAudio: Cannot create mainloop\n");
+        return -1;
+    }
+    pulse_context = pa_context_new(pa_threaded_mainloop_get_api(pulse_mainloop), "KeyboardSounds");
+    if (!pulse_context) {
+        fprintf(stderr, "Could not initialize PulseAudio: Cannot create context\n");
+        pulse_close(0);
+        return -1;
+    }
+    pa_context_set_state_callback(pulse_context, pulse_context_state, NULL);
+    if (pa_context_connect(pulse_context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0) {
+        fprintf(stderr, "Could not initialize PulseAudio: %s\n",
+                pa_strerror(pa_context_errno(pulse_context)));
+        pulse_close(0);
+        return -1;
+    }
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    int result = pulse_connect_stream(target);
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+    if (result != 0) {
+        pulse_close(0);
+    }
+    return result;
+}
+
+// Blocks until the server has room, which paces the mixer
+static int pulse_write(const short *samples, size_t frames) {
+    const char *data = (const char *)samples;
+    size_t bytes = frames * pa_frame_size(&g_output_spec);
+
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    while (bytes > 0) {
+        size_t writable;
+        while ((writable = pa_stream_writable_size(pulse_stream)) == 0) {
+            if (!PA_STREAM_IS_GOOD(pa_stream_get_state(pulse_stream))) {
+                break;
+            }
+            pa_threaded_mainloop_wait(pulse_mainloop);
+        }
+        if (writable == 0 || writable == (size_t)-1) {
+            fprintf(stderr, "PulseAudio write error: %s\n", pa_strerror(pa_context_errno(pulse_context)));
+            pa_threaded_mainloop_unlock(pulse_mainloop);
+            return -1;
+        }
+
+        size_t chunk = writable < bytes ? writable : bytes;
+        if (pa_stream_write(pulse_stream, data, chunk, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+            fprintf(stderr, "PulseAudio write error: %s\n", pa_strerror(pa_context_errno(pulse_context)));
+            pa_threaded_mainloop_unlock(pulse_mainloop);
+            return -1;
+        }
+        data += chunk;
+        bytes -= chunk;
+    }
+
+    // Interpolated from the server's timing updates, no round trip
+    pa_usec_t latency;
+    int negative;
+    if (pa_stream_get_latency(pulse_stream, &latency, &negative) == 0 && !negative) {
+        uint64_t now_us = monotonic_us();
+        record_latency(STAGE_SERVER, now_us, now_us + latency);
+    }
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+    return 0;
+}
+
+// Cork the stream so the server stops mixing it and can suspend the sink,
+// dropping the silence still buffered so nothing stale plays on resume
+static void pulse_suspend() {
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    pulse_wait(pa_stream_cork(pulse_stream, 1, pulse_stream_done, NULL));
+    pulse_wait(pa_stream_flush(pulse_stream, pulse_stream_done, NULL));
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+}
+
+// Not waited for: the server handles it before the write that follows,
+// and playback starts as soon as that first period is in
+static int pulse_resume() {
+    pa_threaded_mainloop_lock(pulse_mainloop);
+    pa_operation *operation = pa_stream_cork(pulse_stream, 0, NULL, NULL);
+    if (!operation) {
+        fprintf(stderr, "PulseAudio resume error: %s\n", pa_strerror(pa_context_errno(pulse_context)));
+        pa_threaded_mainloop_unlock(pulse_mainloop);
+        return -1;
+    }
+    pa_operation_unref(operation);
+    pa_threaded_mainloop_unlock(pulse_mainloop);
+    return 0;
+}
+
+// ALSA, target is a PCM name such as hw:0 (default: "default")
+static snd_pcm_t *alsa_pcm = NULL;
+
+static int alsa_open(const char *target) {
+    int alsa_error = snd_pcm_open(&alsa_pcm, target ? target : "default", SND_PCM_STREAM_PLAYBACK, 0);
+    if (alsa_error < 0) {
+        fprintf(stderr, "Could not open ALSA device %s: %s\n", target ? target : "default",
+                snd_strerror(alsa_error));
+        return -1;
+    }
+
+    alsa_error = snd_pcm_set_params(alsa_pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                    g_output_spec.channels, g_output_spec.rate, 1,
+                                    g_output_latency_ms * 1000);
+    if (alsa_error < 0) {
+        fprintf(stderr, "Could not configure ALSA device: %s\n", snd_strerror(alsa_error));
+        snd_pcm_close(alsa_pcm);
+        alsa_pcm = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int alsa_write(const short *samples, size_t frames) {
+    while (frames > 0) {
+        snd_pcm_sframes_t written = snd_pcm_writei(alsa_pcm, samples, frames);
+        if (written < 0) {
+            // Underruns and suspends are recoverable, just carry on
+            if (snd_pcm_recover(alsa_pcm, (int)written, 1) < 0) {
+                fprintf(stderr, "ALSA write error: %s\n", snd_strerror((int)written));
+                return -1;
+            }
+            continue;
+        }
+        samples += written * g_output_spec.channels;
+        frames -= written;
+    }
+    return 0;
+}
+
+static void alsa_close(int drain) {
+    if (drain) {
+        snd_pcm_drain(alsa_pcm);
+    }
+    snd_pcm_close(alsa_pcm);
+    alsa_pcm = NULL;
+}
+
+// Stop at once, the buffer only holds silence
+static void alsa_suspend() {
+    snd_pcm_drop(alsa_pcm);
+}
+
+static int alsa_resume() {
+    int alsa_error = snd_pcm_prepare(alsa_pcm);
+    if (alsa_error < 0) {
+        fprintf(stderr, "ALSA resume error: %s\n", snd_strerror(alsa_error));
+        return -1;
+    }
+    return 0;
+}
+
+// Sinks without a device behind them sleep as if they had one, unless
+// they run unthrottled for null:unthrottled or --render
+static uint64_t pace_start_us = 0;
+static uint64_t pace_frames = 0;
+static int pace_unthrottled = 0;
+
+static void pace_output(size_t frames) {
+    if (pace_unthrottled) {
+        return;
+    }
+    if (pace_start_us == 0) {
+        pace_start_us = monotonic_us();
+    }
+    pace_frames += frames;
+
+    uint64_t due_us = pace_start_us + pace_frames * 1000000 / g_output_spec.rate;
+    uint64_t now_us = monotonic_us();
+    uint64_t ahead_us = (uint64_t)g_output_latency_ms * 1000;
+    if (due_us > now_us + ahead_us) {
+        usleep(due_us - now_us - ahead_us);
+    }
+}
+
+// Null sink, for benchmarks. "null:unthrottled" mixes as fast as it can.
+static int null_open(const char *target) {
+    if (target && strcmp(target, "unthrottled") != 0) {
+        fprintf(stderr, "Unknown null output mode: %s\n", target);
+        return -1;
+    }
+    if (target) {
+        pace_unthrottled = 1;
+    }
+    return 0;
+}
+
+static int null_write(const short *samples, size_t frames) {
+    (void)samples;
+    pace_output(frames);
+    return 0;
+}
+
+static void null_close(int drain) {
+    (void)drain;
+}
+
+static void null_suspend() {
+}
+
+// Pace from here, not from before the idle time
+static int null_resume() {
+    pace_start_us = 0;
+    pace_frames = 0;
+    return 0;
+}
+
+// WAV file, target is the path (default: mechsim.wav). Written at real-time
+// pace so the recording keeps the timing of the keys.
+static FILE *wav_file = NULL;
+static uint32_t wav_data_bytes = 0;
+static uint64_t file_suspended_us = 0;   // WAV and FLAC
+
+static void put_le16(unsigned char *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+}
+
+static void put_le32(unsigned char *out, uint32_t value) {
+    put_le16(out, value & 0xffff);
+    put_le16(out + 2, value >> 16);
+}
+
+static int wav_write_header() {
+    unsigned char header[44];
+    uint16_t block_align = g_output_spec.channels * sizeof(short);
+
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, 36 + wav_data_bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);                   // PCM
+    put_le16(header + 22, g_output_spec.channels);
+    put_le32(header + 24, g_output_spec.rate);
+    put_le32(header + 28, g_output_spec.rate * block_align);
+    put_le16(header + 32, block_align);
+    put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, wav_data_bytes);
+
+    return fwrite(header, sizeof(header), 1, wav_file) == 1 ? 0 : -1;
+}
+
+static int wav_open(const char *target) {
+    const char *path = target ? target : "mechsim.wav";
+    wav_file = fopen(path, "wb");
+    if (!wav_file) {
+        fprintf(stderr, "Error: Cannot create WAV file: %s\n", path);
+        perror("fopen");
+        return -1;
+    }
+
+    // Sizes are filled in on close
+    wav_data_bytes = 0;
+    if (wav_write_header() != 0) {
+        fprintf(stderr, "Error: Cannot write WAV header: %s\n", path);
+        fclose(wav_file);
+        wav_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int wav_write(const short *samples, size_t frames) {
+    size_t bytes = frames * g_output_spec.channels * sizeof(short);
+    if (wav_data_bytes > UINT32_MAX - 36 - bytes) {
+        return 0;    // RIFF is full, keep playing without recording
+    }
+    if (fwrite(samples, bytes, 1, wav_file) != 1) {
+        perror("fwrite");
+        return -1;
+    }
+    wav_data_bytes += bytes;
+    pace_output(frames);
+    return 0;
+}
+
+static void file_suspend() {
+    file_suspended_us = monotonic_us();
+}
+
+// Fill the idle time with silence so the recording keeps the timing of the keys
+static int file_resume() {
+    static const short silence[MIX_PERIOD_FRAMES * MAX_OUTPUT_CHANNELS];
+    uint64_t frames = (monotonic_us() - file_suspended_us) * g_output_spec.rate / 1000000;
+    while (frames > 0) {
+        size_t chunk = frames < MIX_PERIOD_FRAMES ? (size_t)frames : MIX_PERIOD_FRAMES;
+        if (g_output->write(silence, chunk) != 0) {
+            return -1;
+        }
+        frames -= chunk;
+    }
+    return 0;
+}
+
+static void wav_close(int drain) {
+    (void)drain;
+    if (fseek(wav_file, 0, SEEK_SET) != 0 || wav_write_header() != 0) {
+        fprintf(stderr, "Warning: Could not finish WAV header\n");
+    }
+    fclose(wav_file);
+    wav_file = NULL;
+}
+
+// FLAC file through libsndfile, target is the path (default: mechsim.flac).
+// Paced and kept in time like the WAV file.
+static SNDFILE *flac_file = NULL;
+
+static int flac_open(const char *target) {
+    const char *path = target ? target : "mechsim.flac";
+    SF_INFO info = {
+        .samplerate = g_output_spec.rate,
+        .channels = g_output_spec.channels,
+        .format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16
+    };
+    flac_file = sf_open(path, SFM_WRITE, &info);
+    if (!flac_file) {
+        fprintf(stderr, "Error: Cannot create FLAC file: %s (%s)\n", path, sf_strerror(NULL));
+        return -1;
+    }
+    return 0;
+}
+
+static int flac_write(const short *samples, size_t frames) {
+    if (sf_writef_short(flac_file, samples, frames) != (sf_count_t)frames) {
+        fprintf(stderr, "Error: Cannot write FLAC file: %s\n", sf_strerror(flac_file));
+        return -1;
+    }
+    pace_output(frames);
+    return 0;
+}
+
+static void flac_close(int drain) {
+    (void)drain;
+    sf_close(flac_file);
+    flac_file = NULL;
+}
+
+static const OutputBackend output_backends[] = {
+    { "pulse", pulse_open, pulse_write, pulse_close, 1, pulse_suspend, pulse_resume },
+    { "alsa",  alsa_open,  alsa_write,  alsa_close,  0, alsa_suspend,  alsa_resume },
+    { "null",  null_open,  null_write,  null_close,  0, null_suspend,  null_resume },
+    { "wav",   wav_open,   wav_write,   wav_close,   0, file_suspend,  file_resume },
+    { "flac",  flac_open,  flac_write,  flac_close,  0, file_suspend,  file_resume },
+};
+
+// spec is NAME or NAME:TARGET, e.g. alsa:hw:0 or wav:session.wav
+int select_output(const char *spec) {
+    const char *colon = strchr(spec, ':');
+    size_t length = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    for (size_t i = 0; i < sizeof(output_backends) / sizeof(output_backends[0]); i++) {
+        if (strlen(output_backends[i].name) == length &&
+            strncmp(spec, output_backends[i].name, length) == 0) {
+            g_output = &output_backends[i];
+            g_output_target = colon ? colon + 1 : NULL;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Unknown output: %s\n", spec);
+    return -1;
+}
+
+// Maps CLOCK_MONOTONIC to mixer frames. It follows the times periods are
+// mixed at, smoothed so that wakeup jitter does not move sounds around.
+typedef struct {
+    uint64_t base_us;
+    uint64_t base_frame;
+    int synced;
+} MixerClock;
+
+static void mixer_clock_update(MixerClock *clock, uint64_t frame, uint64_t now_us) {
+    int64_t error = (int64_t)(now_us - clock->base_us) -
+                    (int64_t)((frame - clock->base_frame) * 1000000 / g_output_spec.rate);
+    if (!clock->synced || error > CLOCK_RESYNC_MS * 1000 || error < -CLOCK_RESYNC_MS * 1000) {
+        // First period, or the output stalled: start over from here
+        clock->base_us = now_us;
+        clock->base_frame = frame;
+        clock->synced = 1;
+        return;
+    }
+    clock->base_us += error / 16;
+}
+
+static int64_t mixer_clock_frame(const MixerClock *clock, uint64_t us) {
+    return (int64_t)clock->base_frame + ((int64_t)(us - clock->base_us) * g_output_spec.rate) / 1000000;
+}
+
+// Frames into this period at which the event's sound starts, so that it
+// is heard a fixed --schedule-ms after the key event. -1 holds the event
+// for a later period. Late events and ones without a timestamp start at once.
+static int schedule_offset(const MixerClock *clock, const TriggerEvent *event, uint64_t now_us) {
+    if (g_schedule_delay_us == 0 || event->timing.input_us == 0) {
+        return 0;
+    }
+
+    uint64_t target_us = event->timing.input_us + g_schedule_delay_us;
+    int64_t offset = mixer_clock_frame(clock, target_us) - (int64_t)g_mixer_frame;
+    if (offset >= MIX_PERIOD_FRAMES) {
+        // Hold it, unless the output runs faster than real time or the
+        // timestamp is from some other clock
+        return target_us > now_us && offset < g_output_spec.rate ? -1 : 0;
+    }
+    if (offset < -(int64_t)g_output_spec.rate) {
+        return 0;
+    }
+
+    uint64_t late_us = offset < 0 ? (uint64_t)-offset * 1000000 / g_output_spec.rate : 0;
+    record_latency(STAGE_JITTER, target_us, target_us + late_us);
+    return offset > 0 ? (int)offset : 0;
+}
+
+// Mixer thread: scale the period into out, stepping g_volume towards the
+// target every VOLUME_RAMP_FRAMES so volume changes and mutes do not click
+static void apply_volume(short *out, const int32_t *mix, int channels) {
+    float target;
+    __atomic_load(&g_target_volume, &target, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&g_muted, __ATOMIC_RELAXED)) {
+        target = 0.0f;
+    }
+    if (g_volume == target) {
+        g_mix_kernels->gain_saturate(out, mix, MIX_PERIOD_FRAMES * channels, g_volume);
+        return;
+    }
+
+    float step = (float)VOLUME_RAMP_FRAMES * 1000 / ((float)g_output_spec.rate * VOLUME_RAMP_MS);
+    for (int frame = 0; frame < MIX_PERIOD_FRAMES; frame += VOLUME_RAMP_FRAMES) {
+        g_volume = g_volume < target ? fminf(g_volume + step, target) : fmaxf(g_volume - step, target);
+        g_mix_kernels->gain_saturate(out + frame * channels, mix + frame * channels,
+                                     VOLUME_RAMP_FRAMES * channels, g_volume);
+    }
+}
+
+// Mixer: sum every voice into the next period of out and advance the
+// mixer by it. Returns how many voices are still playing.
+static int mix_period(int32_t *mix, short *out, int channels) {
+    memset(mix, 0, MIX_PERIOD_FRAMES * channels * sizeof(*mix));
+
+    int active = 0;
+    for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+        if (g_voices[i].active) {
+            mix_voice(&g_voices[i], mix, MIX_PERIOD_FRAMES, channels);
+            active += g_voices[i].active;
+        }
+    }
+    __atomic_store_n(&g_active_voices, active, __ATOMIC_RELAXED);
+    if (active > g_stats.peak_voices) {
+        __atomic_store_n(&g_stats.peak_voices, active, __ATOMIC_RELAXED);
+    }
+    g_mixer_frame += MIX_PERIOD_FRAMES;
+
+    apply_volume(out, mix, channels);
+    return active;
+}
+
+// Mixer thread: whether any voice still plays from a pack
+static int pack_in_use(const SoundPack *pack) {
+    for (int i = 0; i < g_voice_pool_size + STEAL_FADE_VOICES; i++) {
+        if (g_voices[i].active && g_voices[i].pack == pack) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Mixer thread: switch to a reloaded pack between periods. Voices already
+// playing carry on from the old one, which is handed back once they are done.
+static void switch_pending_pack() {
+    SoundPack *reloaded = __atomic_exchange_n(&g_pending_pack, NULL, __ATOMIC_ACQUIRE);
+    if (reloaded) {
+        g_retiring_pack = g_sound_pack;
+        g_sound_pack = reloaded;
+    }
+    if (g_retiring_pack && !pack_in_use(g_retiring_pack)) {
+        __atomic_store_n(&g_retired_pack, g_retiring_pack, __ATOMIC_RELEASE);
+        g_retiring_pack = NULL;
+    }
+}
+
+// Mixer thread: nothing has played for --idle-ms, so stop the output and
+// sleep until a key event arrives or the mixer is stopped, handing over
+// reloaded packs meanwhile. Returns when the event that woke it was queued,
+// 0 if none did, or -1 if the output cannot be restarted.
+static int64_t mixer_idle() {
+    uint64_t suspend_us = monotonic_us();
+    RENDER_SECTION(0);
+    g_output->suspend();
+    RENDER_SECTION(1);
+    uint64_t idle_us = monotonic_us();
+    record_latency(STAGE_SUSPEND, suspend_us, idle_us);
+    key_trace_span("suspend", suspend_us, idle_us);
+    __atomic_fetch_add(&g_stats.idle_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_stats.idle_since_us, idle_us, __ATOMIC_RELAXED);
+    if (mixer_verbose()) {
+        printf("Idle, output stopped\n");
+    }
+
+    while (g_mixer_running && event_queue_empty(&g_events)) {
+        // Announce the sleep before the last look, so work handed over
+        // in between either shows up here or posts the semaphore
+        __atomic_store_n(&g_mixer_sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int has_work = !g_mixer_running || __atomic_load_n(&g_pending_pack, __ATOMIC_ACQUIRE) ||
+                       !event_queue_empty(&g_events);
+        if (!has_work || !__atomic_exchange_n(&g_mixer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+            while (sem_wait(&mixer_wakeup) != 0 && errno == EINTR) {
+            }
+        }
+        switch_pending_pack();
+    }
+
+    int64_t woken_us = 0;
+    if (!event_queue_empty(&g_events)) {
+        woken_us = (int64_t)g_events.events[g_events.tail & (EVENT_QUEUE_SIZE - 1)].queued_us;
+    }
+    uint64_t resume_us = monotonic_us();
+    __atomic_fetch_add(&g_stats.idle_us, resume_us - idle_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_stats.idle_since_us, 0, __ATOMIC_RELAXED);
+    key_trace_span("idle", idle_us, resume_us);
+
+    // Also when stopping, a stopped output would never drain
+    RENDER_SECTION(0);
+    int result = g_output->resume();
+    RENDER_SECTION(1);
+    key_trace_span("resume", resume_us, monotonic_us());
+    if (result != 0) {
+        return -1;
+    }
+
+    // Nothing played meanwhile, so volume changes can apply without a ramp
+    float target;
+    __atomic_load(&g_target_volume, &target, __ATOMIC_RELAXED);
+    g_volume = __atomic_load_n(&g_muted, __ATOMIC_RELAXED) ? 0.0f : target;
+    return woken_us;
+}
+
+// Fault in the stack the mixer's calls will use before the first period
+__attribute__((noinline))
+static void prefault_stack() {
+    volatile char stack[MIXER_STACK_PREFAULT];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+    lock_memory((const void *)stack, sizeof(stack));
+}
+
+void* mixer_thread_main(void* arg) {
+    (void)arg;
+    prefault_stack();
+    int channels = g_output_spec.channels;
+    int32_t mix[MIX_PERIOD_FRAMES * MAX_OUTPUT_CHANNELS];
+    short out[MIX_PERIOD_FRAMES * MAX_OUTPUT_CHANNELS];
+
+    // Voices started this period, timed once their first samples are written
+    static TriggerEvent started[EVENT_QUEUE_SIZE];
+    static uint64_t started_popped_us[EVENT_QUEUE_SIZE];
+    // Events scheduled for a later period
+    static TriggerEvent held[EVENT_QUEUE_SIZE];
+    static uint64_t held_popped_us[EVENT_QUEUE_SIZE];
+    int num_held = 0;
+    MixerClock clock = {0};
+    uint64_t period_us = (uint64_t)MIX_PERIOD_FRAMES * 1000000 / g_output_spec.rate;
+    uint64_t last_write_us = 0;
+    uint64_t idle_frames = (uint64_t)g_idle_ms * g_output_spec.rate / 1000;
+    uint64_t silent_frames = 0;    // mixed since the last voice ended
+    uint64_t resumed_us = 0;       // a key event woke the mixer, timed until it is written
+    key_trace_thread("mixer");
+
+    RENDER_SECTION(1);
+    while (g_mixer_running) {
+        switch_pending_pack();
+
+        if (g_idle_ms > 0 && g_output->suspend && silent_frames >= idle_frames &&
+            num_held == 0 && !g_retiring_pack && event_queue_empty(&g_events)) {
+            int64_t woken_us = mixer_idle();
+            if (woken_us < 0) {
+                break;
+            }
+            resumed_us = (uint64_t)woken_us;
+            silent_frames = 0;
+            last_write_us = 0;     // the gap is not an underrun
+            clock.synced = 0;      // nor a clock to smooth over
+            continue;
+        }
+
+        uint64_t period_start_us = monotonic_us();
+        mixer_clock_update(&clock, g_mixer_frame, period_start_us);
+        throttle_refill();
+
+        // Held events first, they are older than anything in the queue
+        int num_started = 0;
+        int num_kept = 0;
+        for (int i = 0; i < num_held; i++) {
+            int offset = schedule_offset(&clock, &held[i], period_start_us);
+            if (offset < 0) {
+                held_popped_us[num_kept] = held_popped_us[i];
+                held[num_kept++] = held[i];
+            } else if (start_voice(&held[i], offset) == 0) {
+                started[num_started] = held[i];
+                started_popped_us[num_started++] = held_popped_us[i];
+            }
+        }
+        num_held = num_kept;
+
+        TriggerEvent event;
+        while (num_started < EVENT_QUEUE_SIZE && num_held < EVENT_QUEUE_SIZE &&
+               event_queue_pop(&g_events, &event)) {
+            uint64_t popped_us = monotonic_us();
+            record_latency(STAGE_QUEUE, event.queued_us, popped_us);
+            key_trace_key("queue", event.queued_us, popped_us, event.key_code, event.timing.input_us);
+            int offset = schedule_offset(&clock, &event, period_start_us);
+            if (offset < 0) {
+                held_popped_us[num_held] = popped_us;
+                held[num_held++] = event;
+            } else if (start_voice(&event, offset) == 0) {
+                started[num_started] = event;
+                started_popped_us[num_started++] = popped_us;
+            }
+        }
+
+        int active = mix_period(mix, out, channels);
+        silent_frames = active > 0 || num_held > 0 ? 0 : silent_frames + MIX_PERIOD_FRAMES;
+        uint64_t mixed_us = key_trace_enabled() ? monotonic_us() : 0;
+
+        // The blocking write paces the mixer at the output rate
+        RENDER_SECTION(0);
+        if (g_output->write(out, MIX_PERIOD_FRAMES) != 0) {
+            break;
+        }
+        RENDER_SECTION(1);
+
+        uint64_t written_us = monotonic_us();
+        key_trace_span("mix", period_start_us, mixed_us);
+        key_trace_span("output_write", mixed_us, written_us);
+        for (int i = 0; i < num_started; i++) {
+            const TriggerEvent *done = &started[i];
+            record_latency(STAGE_OUTPUT, started_popped_us[i], written_us);
+            record_latency(STAGE_TOTAL, done->timing.input_us, written_us);
+            key_trace_key("output", started_popped_us[i], written_us, done->key_code, done->timing.input_us);
+            if (done->timing.input_us) {
+                key_trace_key("keystroke", done->timing.input_us, written_us, done->key_code,
+                              done->timing.input_us);
+            }
+        }
+        record_latency(STAGE_RESUME, resumed_us, written_us);
+        resumed_us = 0;
+
+        // A write that returns later than the whole output buffer means it ran dry
+        if (!g_output->reports_underruns && last_write_us &&
+            written_us - last_write_us > (uint64_t)g_output_latency_ms * 1000 + period_us) {
+            __atomic_fetch_add(&g_stats.underruns, 1, __ATOMIC_RELAXED);
+        }
+        last_write_us = written_us;
+    }
+
+    RENDER_SECTION(0);
+    return NULL;
+}
+
+// Pin the mixer and give it real-time priority where asked for. Neither
+// is fatal, the mixer just keeps running as a normal thread.
+static void configure_mixer_thread() {
+    if (g_mixer_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(g_mixer_cpu, &cpus);
+        int err = pthread_setaffinity_np(mixer_thread, sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "Warning: Cannot pin the mixer to CPU %d: %s\n", g_mixer_cpu, strerror(err));
+        }
+    }
+
+    if (g_realtime_priority > 0) {
+        struct sched_param param = { .sched_priority = g_realtime_priority };
+        int err = pthread_setschedparam(mixer_thread, SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "Warning: Cannot run the mixer with SCHED_FIFO priority %d: %s\n",
+                    g_realtime_priority, strerror(err));
+            fprintf(stderr, "Raise the limit with ulimit -r, or run with CAP_SYS_NICE\n");
+        } else {
+            printf("Mixer thread: SCHED_FIFO priority %d\n", g_realtime_priority);
+        }
+    }
+}
+
+// Voice pool and output, for the mixer thread or --render
+static int init_mix_engine() {
+    if (g_sound_pack->store.num_sources == 0) {
+        fprintf(stderr, "Error: No sounds in the pack, nothing to play\n");
+        return -1;
+    }
+
+    if (!g_mix_kernels && select_mix_kernels(NULL) != 0) {
+        return -1;
+    }
+
+    // The whole pool is allocated up front, starting a voice never allocates
+    g_voices = calloc(g_voice_pool_size + STEAL_FADE_VOICES, sizeof(Voice));
+    if (!g_voices) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    lock_memory(g_voices, (g_voice_pool_size + STEAL_FADE_VOICES) * sizeof(Voice));
+    lock_memory(&g_events, sizeof(g_events));
+
+    g_output_spec.rate = g_sound_pack->store.samplerate;
+    g_output_spec.channels = g_sound_pack->store.channels;
+    mixer_random_state = (uint32_t)monotonic_us() | 1;
+
+    if (!g_output) {
+        g_output = &output_backends[0];
+    }
+    if (g_output->open(g_output_target) != 0) {
+        return -1;
+    }
+    g_output_open = 1;
+
+    printf("Output stream: %s%s%s, %u Hz, %u channels\n", g_output->name,
+           g_output_target ? ":" : "", g_output_target ? g_output_target : "",
+           g_output_spec.rate, g_output_spec.channels);
+    printf("Voice pool: %d voices, steal policy: %s, mix kernel: %s\n",
+           g_voice_pool_size, steal_policy_names[g_steal_policy], g_mix_kernels->name);
+    return 0;
+}
+
+int init_mixer() {
+    if (init_mix_engine() != 0) {
+        return -1;
+    }
+
+    if (sem_init(&mixer_wakeup, 0, 0) != 0) {
+        perror("sem_init");
+        g_output->close(0);
+        g_output_open = 0;
+        return -1;
+    }
+
+    g_mixer_running = 1;
+    if (pthread_create(&mixer_thread, NULL, mixer_thread_main, NULL) != 0) {
+        fprintf(stderr, "Failed to create mixer thread\n");
+        g_mixer_running = 0;
+        sem_destroy(&mixer_wakeup);
+        g_output->close(0);
+        g_output_open = 0;
+        return -1;
+    }
+    configure_mixer_thread();
+
+    if (g_idle_ms > 0 && g_output->suspend) {
+        printf("Output stops after %d ms without sound\n", g_idle_ms);
+    }
+    return 0;
+}
+
+void play_sound_segment(int key_code, int is_pressed, const EventTiming *timing) {
+    __atomic_fetch_add(&g_stats.events, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&g_paused, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    TriggerEvent event = {
+        .queued_us = monotonic_us(),
+        .key_code = (uint16_t)key_code,
+        .is_pressed = (uint8_t)(is_pressed != 0)
+    };
+    if (timing) {
+        event.timing = *timing;
+    }
+
+    if (key_code < 0 || key_code > UINT16_MAX || event_queue_push(&g_events, &event) != 0) {
+        if (g_verbose) {
+            printf("Warning: Dropped event for key %d\n", key_code);
+        }
+        return;
+    }
+    wake_mixer();
+
+    // Without a pipe the input stage runs straight into the queue
+    record_latency(STAGE_INPUT, event.timing.input_us,
+                   event.timing.sent_us ? event.timing.sent_us : event.queued_us);
+    record_latency(STAGE_IPC, event.timing.sent_us, event.timing.read_us);
+    record_latency(STAGE_PARSE, event.timing.read_us, event.queued_us);
+
+    // Before the pipe, get_key_presses traces the input stage itself
+    if (!event.timing.sent_us) {
+        key_trace_key("input", event.timing.input_us, event.queued_us, key_code, event.timing.input_us);
+    }
+    key_trace_key("ipc", event.timing.sent_us, event.timing.read_us, key_code, event.timing.input_us);
+    key_trace_key("parse", event.timing.read_us, event.queued_us, key_code, event.timing.input_us);
+}
+
+int parse_keyboard_event(const char *json_line, int *key_code, int *is_pressed, EventTiming *timing) {
+    // Strip newline if present
+    char *line_copy = strdup(json_line);
+    if (!line_copy) return -1;
+    
+    char *newline = strchr(line_copy, '\n');
+    if (newline) *newline = '\0';
+    
+    if (g_verbose) {
+        printf("Parsing JSON: %s\n", line_copy);
+    }
+
+    json_object *root = json_tokener_parse(line_copy);
+    free(line_copy);
+    
+    if (!root) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", json_line);
+        return -1;
+    }
+
+    json_object *key_code_obj, *state_code_obj;
+    
+    if (json_object_object_get_ex(root, "key_code", &key_code_obj) &&
+        json_object_object_get_ex(root, "state_code", &state_code_obj)) {
+        
+        *key_code = json_object_get_int(key_code_obj);
+        *is_pressed = json_object_get_int(state_code_obj);
+
+        // Timestamps are only present from newer get_key_presses builds
+        json_object *time_obj;
+        if (json_object_object_get_ex(root, "time_usec", &time_obj)) {
+            timing->input_us = (uint64_t)json_object_get_int64(time_obj);
+        }
+        if (json_object_object_get_ex(root, "sent_usec", &time_obj)) {
+            timing->sent_us = (uint64_t)json_object_get_int64(time_obj);
+        }
+        
+        if (g_verbose) {
+            printf("Parsed key event: key_code=%d, is_pressed=%d\n", *key_code, *is_pressed);
+        }
+        
+        json_object_put(root);
+        return 0;
+    }
+
+    json_object_put(root);
+    return -1;
+}
+
+// Handle every complete JSON line available on stdin in one read. Lines
+// buffered inside stdio would be invisible to select(), so split them here.
+int read_json_events() {
+    static char buffer[MAX_LINE_LENGTH * 4];
+    static size_t buffered = 0;   // may end in a partial line
+
+    uint64_t start_us = key_trace_enabled() ? monotonic_us() : 0;
+    ssize_t bytes = read(STDIN_FILENO, buffer + buffered, sizeof(buffer) - buffered);
+    if (bytes == 0) {
+        printf("EOF reached on stdin\n");
+        return -1;
+    }
+    if (bytes < 0) {
+        if (errno == EINTR) return 0;
+        perror("read");
+        return -1;
+    }
+    buffered += bytes;
+
+    uint64_t read_us = monotonic_us();
+    key_trace_span("read", start_us, read_us);
+    char *line = buffer, *newline;
+    while ((newline = memchr(line, '\n', buffer + buffered - line)) != NULL) {
+        *newline = '\0';
+        EventTiming timing = { .read_us = read_us };
+        int key_code, is_pressed;
+        uint64_t parse_us = key_trace_enabled() ? monotonic_us() : 0;
+        int parsed = parse_keyboard_event(line, &key_code, &is_pressed, &timing);
+        if (parse_us) {
+            key_trace_span("json_parse", parse_us, monotonic_us());
+        }
+        if (parsed == 0) {
+            play_sound_segment(key_code, is_pressed, &timing);
+        }
+        line = newline + 1;
+    }
+
+    size_t remaining = buffer + buffered - line;
+    if (remaining == sizeof(buffer)) {
+        fprintf(stderr, "Warning: Dropped overlong input line\n");
+        remaining = 0;
+    }
+    memmove(buffer, line, remaining);
+    buffered = remaining;
+    return 0;
+}
+
+// Handle every complete binary record available on stdin in one read
+int read_binary_events() {
+    static struct key_event_record records[KEY_EVENT_BATCH_MAX];
+    static size_t buffered = 0;   // bytes, may end in a partial record
+
+    uint64_t start_us = key_trace_enabled() ? monotonic_us() : 0;
+    ssize_t bytes = read(STDIN_FILENO, (char *)records + buffered, sizeof(records) - buffered);
+    if (bytes == 0) {
+        printf("EOF reached on stdin\n");
+        return -1;
+    }
+    if (bytes < 0) {
+        if (errno == EINTR) return 0;
+        perror("read");
+        return -1;
+    }
+    buffered += bytes;
+
+    uint64_t read_us = monotonic_us();
+    key_trace_span("read", start_us, read_us);
+    size_t count = buffered / KEY_EVENT_RECORD_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if (g_verbose) {
+            printf("Binary key event: key_code=%d, is_pressed=%d, device=%u\n",
+                   records[i].key_code, records[i].state, records[i].device_id);
+        }
+        EventTiming timing = {
+            .input_us = records[i].time_usec,
+            .sent_us = records[i].sent_usec,
+            .read_us = read_us
+        };
+        play_sound_segment(records[i].key_code, records[i].state, &timing);
+    }
+
+    size_t consumed = count * KEY_EVENT_RECORD_SIZE;
+    memmove(records, (char *)records + consumed, buffered - consumed);
+    buffered -= consumed;
+    return 0;
+}
+
+// --render: read a whole recorded session, what get_key_presses wrote to
+// stdout saved to a file. Events without a timestamp take the previous one's.
+static TriggerEvent *read_session(const char *path, size_t *count) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open key event trace: %s\n", path);
+        perror("fopen");
+        return NULL;
+    }
+
+    size_t capacity = 1024;
+    TriggerEvent *events = malloc(capacity * sizeof(TriggerEvent));
+    *count = 0;
+    uint64_t last_us = 0;
+    char line[MAX_LINE_LENGTH];
+    struct key_event_record record;
+    while (events) {
+        EventTiming timing = {0};
+        int key_code, is_pressed;
+        if (g_binary_input) {
+            if (fread(&record, KEY_EVENT_RECORD_SIZE, 1, file) != 1) {
+                break;
+            }
+            key_code = record.key_code;
+            is_pressed = record.state;
+            timing.input_us = record.time_usec;
+        } else {
+            if (!fgets(line, sizeof(line), file)) {
+                break;
+            }
+            if (line[strspn(line, " \t\r\n")] == '\0' ||
+                parse_keyboard_event(line, &key_code, &is_pressed, &timing) != 0) {
+                continue;
+            }
+        }
+        if (key_code < 0 || key_code > UINT16_MAX) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            TriggerEvent *grown = realloc(events, capacity * sizeof(TriggerEvent));
+            if (!grown) {
+                free(events);
+                events = NULL;
+                break;
+            }
+            events = grown;
+        }
+        last_us = timing.input_us ? timing.input_us : last_us;
+        events[(*count)++] = (TriggerEvent){
+            .timing = { .input_us = last_us },
+            .key_code = (uint16_t)key_code,
+            .is_pressed = (uint8_t)(is_pressed != 0)
+        };
+    }
+    fclose(file);
+
+    if (!events) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    if (*count == 0) {
+        fprintf(stderr, "Error: No key events in %s\n", path);
+        free(events);
+        return NULL;
+    }
+    return events;
+}
+
+// --render: mix a recorded session into the output on this thread, as fast
+// as it goes. Sounds start where the live mixer would put them, --schedule-ms
+// after their key event, through the same voices, policies and kernels.
+// Every sample is decoded beforehand and generic presses are picked in the
+// same order every run, so one session and pack always render the same.
+static int render_session(const char *trace_path) {
+    size_t count;
+    TriggerEvent *events = read_session(trace_path, &count);
+    if (!events) {
+        return -1;
+    }
+
+    int channels = g_output_spec.channels;
+    int32_t mix[MIX_PERIOD_FRAMES * MAX_OUTPUT_CHANNELS];
+    short out[MIX_PERIOD_FRAMES * MAX_OUTPUT_CHANNELS];
+    uint64_t first_us = events[0].timing.input_us;
+    uint64_t start_us = monotonic_us();
+    size_t next = 0;
+    int active = 0;
+    int result = 0;
+
+    mixer_random_state = RENDER_RANDOM_SEED;
+    pace_unthrottled = 1;
+    while (next < count || active > 0) {
+        throttle_refill();
+        for (; next < count; next++) {
+            int64_t event_us = (int64_t)(events[next].timing.input_us - first_us) + (int64_t)g_schedule_delay_us;
+            int64_t offset = event_us * g_output_spec.rate / 1000000 - (int64_t)g_mixer_frame;
+            if (offset >= MIX_PERIOD_FRAMES) {
+                break;
+            }
+            start_voice(&events[next], offset > 0 ? (int)offset : 0);
+        }
+
+        active = mix_period(mix, out, channels);
+        if (g_output->write(out, MIX_PERIOD_FRAMES) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    uint64_t end_us = monotonic_us();
+    key_trace_span("render", start_us, end_us);
+    double audio_s = (double)g_mixer_frame / g_output_spec.rate;
+    double took_s = (end_us - start_us) / 1000000.0;
+    printf("Rendered %.1f s of audio from %zu key events in %.2f s (%.0fx real time)\n",
+           audio_s, count, took_s, took_s > 0 ? audio_s / took_s : 0.0);
+    free(events);
+    return result;
+}
+
+#ifdef MECHSIM_INPROCESS
+// In-process mode: libinput events go straight into the event queue
+static void handle_key_input(struct libinput_event *event, void *user_data) {
+    (void)user_data;
+
+    // Pointer buttons are never mapped to a sound
+    if (libinput_event_get_type(event) != LIBINPUT_EVENT_KEYBOARD_KEY) {
+        return;
+    }
+
+    struct libinput_event_keyboard *keyboard = libinput_event_get_keyboard_event(event);
+    int key_code = libinput_event_keyboard_get_key(keyboard);
+    int is_pressed = libinput_event_keyboard_get_key_state(keyboard) == LIBINPUT_KEY_STATE_PRESSED;
+
+    if (g_verbose) {
+        printf("Key event: key_code=%d, is_pressed=%d\n", key_code, is_pressed);
+    }
+    EventTiming timing = {
+        .input_us = libinput_event_keyboard_get_time_usec(keyboard)
+    };
+    play_sound_segment(key_code, is_pressed, &timing);
+}
+
+static void handle_evdev_key(const struct key_evdev_event *event, void *user_data) {
+    (void)user_data;
+
+    if (g_verbose) {
+        printf("Key event: key_code=%u, is_pressed=%d\n", event->key_code, event->pressed);
+    }
+    EventTiming timing = { .input_us = event->time_usec };
+    play_sound_segment(event->key_code, event->pressed, &timing);
+}
+
+// Read the --device keyboards on this thread until they are gone
+static int run_evdev() {
+    evdev_input.handler = handle_evdev_key;
+    pack_key_filter(g_sound_pack, evdev_input.filter);
+    if (key_evdev_open(&evdev_input, device_paths, num_device_paths) != NO_ERROR) {
+        return -1;
+    }
+    __atomic_store_n(&evdev_running, 1, __ATOMIC_RELEASE);
+
+    int result = key_evdev_run(&evdev_input);
+    __atomic_store_n(&evdev_running, 0, __ATOMIC_RELEASE);
+    key_evdev_close(&evdev_input);
+    return result;
+}
+
+// Run the libinput loop on this thread until it fails
+int run_inprocess() {
+    if (num_device_paths > 0) {
+        return run_evdev();
+    }
+
+    struct key_input input = { .handler = handle_key_input };
+    if (key_input_open(&input) != NO_ERROR) {
+        return -1;
+    }
+
+    int result = key_input_run(&input);
+    key_input_close(&input);
+    return result;
+}
+#endif
+
+void cleanup() {
+    printf("Cleaning up...\n");
+    
+    // Let queued and ringing voices finish naturally, for at most 500ms
+    for (int waited = 0; waited < 50 && g_mixer_running; waited++) {
+        int queued = __atomic_load_n(&g_events.head, __ATOMIC_ACQUIRE) !=
+                     __atomic_load_n(&g_events.tail, __ATOMIC_ACQUIRE);
+        if (!queued && __atomic_load_n(&g_active_voices, __ATOMIC_RELAXED) == 0) break;
+        usleep(10000);
+    }
+
+    if (g_mixer_running) {
+        g_mixer_running = 0;
+        wake_mixer();
+        pthread_join(mixer_thread, NULL);
+        sem_destroy(&mixer_wakeup);
+    }
+    if (g_output_open) {
+        g_output->close(1);
+        g_output_open = 0;
+    }
+
+    unsigned long overflows = __atomic_load_n(&g_events.overflows, __ATOMIC_RELAXED);
+    if (overflows > 0) {
+        printf("Dropped %lu key events (event queue full)\n", overflows);
+    }
+    printf("Voices stolen: %lu, dropped: %lu, cut: %lu\n", g_voices_stolen, g_voices_dropped, g_voices_cut);
+    if (g_events_throttled > 0) {
+        printf("Dropped %lu key events (over --max-event-rate)\n", g_events_throttled);
+    }
+
+    if (g_verbose) {
+        print_stats(stdout);
+    }
+    write_stats_file();
+
+    free(g_voices);
+    g_voices = NULL;
+
+    // Workers may still be decoding into the sources
+    __atomic_store_n(&decode_cancel, 1, __ATOMIC_RELAXED);
+    stop_reload();
+    wait_for_decoding();
+
+    // Including a reloaded pack the mixer never picked up or never handed back
+    free_sound_pack(g_pending_pack);
+    free_sound_pack(g_retired_pack);
+    free_sound_pack(g_retiring_pack);
+    free_sound_pack(g_sound_pack);
+    g_pending_pack = g_retired_pack = g_retiring_pack = g_sound_pack = NULL;
+}
+
+static int find_retrigger_policy(const char *name, RetriggerPolicy *policy) {
+    for (int i = 0; i < (int)(sizeof(retrigger_policy_names) / sizeof(retrigger_policy_names[0])); i++) {
+        if (strcmp(name, retrigger_policy_names[i]) == 0) {
+            *policy = (RetriggerPolicy)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown retrigger policy: %s\n", name);
+    return -1;
+}
+
+// "POLICY" for every key and "KEY=POLICY" for one, comma separated,
+// e.g. "cut,57=overlap". Key overrides win wherever they are in the list.
+static int parse_retrigger(const char *spec) {
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s", spec);
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            for (int key = 0; key < 256; key++) g_key_retrigger[key] = g_retrigger_policy;
+        }
+        char buffer[sizeof(copy)];
+        memcpy(buffer, copy, sizeof(buffer));
+        char *save;
+        for (char *item = strtok_r(buffer, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+            char *equals = strchr(item, '=');
+            if (pass == 0) {
+                if (!equals && find_retrigger_policy(item, &g_retrigger_policy) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (!equals) {
+                continue;
+            }
+            *equals = '\0';
+            char *end;
+            long key = strtol(item, &end, 10);
+            if (end == item || *end != '\0' || key < 0 || key > 255) {
+                fprintf(stderr, "Invalid key code in retrigger policy: %s\n", item);
+                return -1;
+            }
+            if (find_retrigger_policy(equals + 1, &g_key_retrigger[key]) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// One tab separated line for mechsim's pack catalog, printed by --build-cache
+static void print_catalog_entry(const SoundPack *pack, uint64_t load_us) {
+    char name[sizeof(pack->name)];
+    snprintf(name, sizeof(name), "%s", pack->name);
+    for (char *c = name; *c; c++) {
+        if (*c == '\t' || *c == '\n' || *c == '\r') *c = ' ';
+    }
+
+    // Packs are all one rate in practice, report the highest if not
+    int source_rate = 0;
+    for (int i = 0; i < pack->store.num_sources; i++) {
+        if (pack->store.sources[i].source_rate > source_rate) {
+            source_rate = pack->store.sources[i].source_rate;
+        }
+    }
+
+    printf("Catalog\t%s\t%s\t%d\t%zu\t%d\t%llu\n", name, pack->is_multi ? "multi" : "single",
+           pack->store.num_sources, sample_store_bytes(pack), source_rate, (unsigned long long)load_us);
+}
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS] <config.json> [volume] [verbose]\n", program_name);
+    fprintf(stderr, "  volume: 0-100 (default: 50)\n");
+    fprintf(stderr, "  verbose: 1 to enable verbose output (default: 0)\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  -n, --voices COUNT       Voices that can play at once (default: %d)\n", MAX_CONCURRENT_SOUNDS);
+    fprintf(stderr, "  -S, --steal POLICY       When all voices are busy: none, oldest,\n");
+    fprintf(stderr, "                           quietest or retrigger (default: oldest)\n");
+    fprintf(stderr, "      --retrigger SPEC     What a key's new sound does to the ones it still plays:\n");
+    fprintf(stderr, "                           overlap, cut, cap (at --key-voices) or release (its\n");
+    fprintf(stderr, "                           release fades the press out), for every key or as\n");
+    fprintf(stderr, "                           KEY=POLICY, e.g. cut,57=overlap (default: overlap)\n");
+    fprintf(stderr, "      --key-voices COUNT   Voices one key can play with --retrigger cap (default: %d)\n", KEY_VOICE_CAP);
+    fprintf(stderr, "      --max-event-rate N   Start at most N sounds per second, 0 for no limit\n");
+    fprintf(stderr, "                           (default: 0)\n");
+    fprintf(stderr, "      --mlock              Lock sample data and mixer state in memory\n");
+    fprintf(stderr, "      --realtime PRIO      Run the mixer with SCHED_FIFO priority PRIO (1-99)\n");
+    fprintf(stderr, "      --cpu N              Pin the mixer to CPU N\n");
+    fprintf(stderr, "  -k, --kernel NAME        Mix kernel: auto, avx2, sse2 or scalar (default: auto)\n");
+    fprintf(stderr, "  -b, --binary             Read binary key event records instead of JSON lines\n");
+    fprintf(stderr, "  -o, --output BACKEND     pulse[:SINK], alsa[:DEVICE], null[:unthrottled],\n");
+    fprintf(stderr, "                           wav[:FILE] or flac[:FILE] (default: pulse)\n");
+    fprintf(stderr, "      --latency-ms MS      Audio buffered ahead of what is heard, less uses more\n");
+    fprintf(stderr, "                           CPU and risks underruns (default: %d)\n", OUTPUT_LATENCY_MS);
+    fprintf(stderr, "      --schedule-ms MS     Start each sound MS after its key event, keeping the\n");
+    fprintf(stderr, "                           rhythm of the typing; 0 plays as soon as possible\n");
+    fprintf(stderr, "                           (default: %d)\n", SCHEDULE_DELAY_MS);
+    fprintf(stderr, "      --idle-ms MS         Stop the output after MS without sound and sleep\n");
+    fprintf(stderr, "                           until the next key; 0 keeps it running (default: %d)\n", IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  -i, --inprocess          Read keys from libinput directly instead of stdin\n");
+    fprintf(stderr, "      --device PATH        With --inprocess, read this evdev keyboard instead of\n");
+    fprintf(stderr, "                           libinput, \"auto\" for every keyboard (repeatable)\n");
+    fprintf(stderr, "                           (keyboard_sound_player_inprocess only, needs root)\n");
+    fprintf(stderr, "  -r, --rate HZ            Mixer and output rate, samples are converted to it\n");
+    fprintf(stderr, "                           (default: %d)\n", ENGINE_RATE);
+    fprintf(stderr, "  -c, --channels COUNT     Output channels, 1 or 2 (default: 2)\n");
+    fprintf(stderr, "      --resample-quality Q fast, medium or best (default: medium)\n");
+    fprintf(stderr, "      --cache-dir DIR      Where compiled packs are kept\n");
+    fprintf(stderr, "                           (default: $XDG_CACHE_HOME/mechsim or ~/.cache/mechsim)\n");
+    fprintf(stderr, "      --no-cache           Always decode the pack, do not read or write the cache\n");
+    fprintf(stderr, "      --build-cache        Compile the pack into the cache, print its catalog\n");
+    fprintf(stderr, "                           line for mechsim, then exit\n");
+    fprintf(stderr, "      --memory-budget SIZE Keep at most SIZE of decoded sound (K, M or G),\n");
+    fprintf(stderr, "                           decoding the rest on first use (default: no limit)\n");
+    fprintf(stderr, "      --stats-file PATH    Write latency and voice stats here on exit\n");
+    fprintf(stderr, "                           (send SIGUSR1 to print them at any time)\n");
+    fprintf(stderr, "      --trace FILE         Append a Chrome trace of each keystroke's path and\n");
+    fprintf(stderr, "                           of the mixer to FILE, for ui.perfetto.dev\n");
+    fprintf(stderr, "      --render TRACE       Mix a recorded session (get_key_presses output saved\n");
+    fprintf(stderr, "                           to a file) into a wav or flac --output as fast as\n");
+    fprintf(stderr, "                           possible, then exit\n");
+    fprintf(stderr, "      --control-socket PATH\n");
+    fprintf(stderr, "                           Accept one-line commands on a UNIX socket: volume\n");
+    fprintf(stderr, "                           [N|+N|-N], mute|pause [on|off|toggle], pack CONFIG,\n");
+    fprintf(stderr, "                           reload, stats and quit\n");
+    fprintf(stderr, "\nThe pack is reloaded when config.json changes or on SIGHUP.\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"voices", required_argument, 0, 'n'},
+        {"steal",  required_argument, 0, 'S'},
+        {"kernel", required_argument, 0, 'k'},
+        {"binary", no_argument,       0, 'b'},
+        {"output", required_argument, 0, 'o'},
+        {"latency-ms", required_argument, 0, 'D'},
+        {"schedule-ms", required_argument, 0, 'J'},
+        {"idle-ms", required_argument, 0, 'W'},
+        {"inprocess", no_argument,    0, 'i'},
+        {"device", required_argument, 0, 'I'},
+        {"stats-file", required_argument, 0, 'T'},
+        {"trace",  required_argument, 0, 'Z'},
+        {"render", required_argument, 0, 'X'},
+        {"cache-dir", required_argument, 0, 'C'},
+        {"no-cache", no_argument,     0, 'N'},
+        {"build-cache", no_argument,  0, 'B'},
+        {"rate",   required_argument, 0, 'r'},
+        {"channels", required_argument, 0, 'c'},
+        {"resample-quality", required_argument, 0, 'Q'},
+        {"memory-budget", required_argument, 0, 'M'},
+        {"control-socket", required_argument, 0, 'U'},
+        {"retrigger", required_argument, 0, 'R'},
+        {"key-voices", required_argument, 0, 'K'},
+        {"max-event-rate", required_argument, 0, 'E'},
+        {"mlock", no_argument,        0, 'L'},
+        {"realtime", required_argument, 0, 'P'},
+        {"cpu",    required_argument, 0, 'A'},
+        {0, 0, 0, 0}
+    };
+
+    int build_cache = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:S:k:bo:ir:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                g_voice_pool_size = atoi(optarg);
+                if (g_voice_pool_size < 1) g_voice_pool_size = 1;
+                if (g_voice_pool_size > MAX_VOICE_POOL) g_voice_pool_size = MAX_VOICE_POOL;
+                break;
+            case 'S': {
+                int found = 0;
+                for (int i = 0; i < (int)(sizeof(steal_policy_names) / sizeof(steal_policy_names[0])); i++) {
+                    if (strcmp(optarg, steal_policy_names[i]) == 0) {
+                        g_steal_policy = (StealPolicy)i;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "Unknown steal policy: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'k':
+                if (select_mix_kernels(optarg) != 0) {
+                    return 1;
+                }
+                break;
+            case 'b':
+                g_binary_input = 1;
+                break;
+            case 'o':
+                if (select_output(optarg) != 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'T':
+                g_stats_path = optarg;
+                break;
+            case 'Z':
+                g_trace_path = optarg;
+                break;
+            case 'X':
+                g_render_path = optarg;
+                break;
+            case 'C':
+                g_cache_dir = optarg;
+                break;
+            case 'U':
+                g_control_path = optarg;
+                break;
+            case 'R':
+                if (parse_retrigger(optarg) != 0) {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'K':
+                g_key_voice_cap = atoi(optarg);
+                if (g_key_voice_cap < 1) g_key_voice_cap = 1;
+                if (g_key_voice_cap > MAX_VOICE_POOL) g_key_voice_cap = MAX_VOICE_POOL;
+                break;
+            case 'E':
+                g_max_event_rate = atoi(optarg);
+                if (g_max_event_rate < 0) g_max_event_rate = 0;
+                break;
+            case 'L':
+                g_lock_memory = 1;
+                break;
+            case 'P':
+                g_realtime_priority = atoi(optarg);
+                if (g_realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+                    g_realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+                    fprintf(stderr, "Real-time priority must be between %d and %d\n",
+                            sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+                    return 1;
+                }
+                break;
+            case 'D':
+                g_output_latency_ms = atoi(optarg);
+                if (g_output_latency_ms < 1 || g_output_latency_ms > 1000) {
+                    fprintf(stderr, "Output latency must be between 1 and 1000 ms\n");
+                    return 1;
+                }
+                break;
+            case 'J': {
+                int delay_ms = atoi(optarg);
+                if (delay_ms < 0 || delay_ms > 1000) {
+                    fprintf(stderr, "Schedule delay must be between 0 and 1000 ms\n");
+                    return 1;
+                }
+                g_schedule_delay_us = (uint64_t)delay_ms * 1000;
+                break;
+            }
+            case 'W':
+                g_idle_ms = atoi(optarg);
+                if (g_idle_ms < 0 || g_idle_ms > 3600000) {
+                    fprintf(stderr, "Idle time must be between 0 and 3600000 ms\n");
+                    return 1;
+                }
+                break;
+            case 'A':
+                g_mixer_cpu = atoi(optarg);
+                if (g_mixer_cpu < 0 || g_mixer_cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid CPU: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'N':
+                g_use_cache = 0;
+                break;
+            case 'B':
+                build_cache = 1;
+                break;
+            case 'M': {
+                char *end;
+                unsigned long long budget = strtoull(optarg, &end, 10);
+                switch (*end) {
+                    case 'G': case 'g': budget <<= 10; // fall through
+                    case 'M': case 'm': budget <<= 10; // fall through
+                    case 'K': case 'k': budget <<= 10; end++; break;
+                }
+                if (end == optarg || *end != '\0' || budget == 0) {
+                    fprintf(stderr, "Invalid memory budget: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                g_memory_budget = (size_t)budget;
+                break;
+            }
+            case 'r':
+                g_engine_rate = atoi(optarg);
+                if (g_engine_rate < 8000 || g_engine_rate > 192000) {
+                    fprintf(stderr, "Rate must be between 8000 and 192000 Hz\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                g_engine_channels = atoi(optarg);
+                if (g_engine_channels < 1 || g_engine_channels > MAX_OUTPUT_CHANNELS) {
+                    fprintf(stderr, "Channels must be 1 or %d\n", MAX_OUTPUT_CHANNELS);
+                    return 1;
+                }
+                break;
+            case 'Q': {
+                int found = 0;
+                for (int i = 0; i < (int)(sizeof(resample_quality_names) / sizeof(resample_quality_names[0])); i++) {
+                    if (strcmp(optarg, resample_quality_names[i]) == 0) {
+                        g_resample_quality = (ResampleQuality)i;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "Unknown resample quality: %s\n", optarg);
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'i':
+#ifdef MECHSIM_INPROCESS
+                g_inprocess = 1;
+                break;
+#else
+                fprintf(stderr, "In-process mode needs keyboard_sound_player_inprocess\n");
+                return 1;
+#endif
+            case 'I':
+#ifdef MECHSIM_INPROCESS
+                if (num_device_paths == KEY_EVDEV_MAX_DEVICES) {
+                    fprintf(stderr, "Too many devices\n");
+                    return 1;
+                }
+                device_paths[num_device_paths++] = optarg;
+                break;
+#else
+                fprintf(stderr, "--device needs keyboard_sound_player_inprocess\n");
+                return 1;
+#endif
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    int positional = argc - optind;
+    if (positional < 1 || positional > 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *config_path = argv[optind];
+
+    // Set volume
+    if (positional >= 2) {
+        int volume_percent = atoi(argv[optind + 1]);
+        if (volume_percent < 0) volume_percent = 0;
+        if (volume_percent > 100) volume_percent = 100;
+        g_volume = g_target_volume = volume_percent / 100.0f;
+        printf("Volume set to: %d%%\n", volume_percent);
+    } else {
+        printf("Volume set to: 50%% (default)\n");
+    }
+    
+    // Set verbose mode
+    if (positional >= 3) {
+        g_verbose = atoi(argv[optind + 2]);
+        if (g_verbose) {
+            printf("Verbose mode enabled\n");
+        }
+    }
+
+    if (build_cache) {
+        // Compiling needs every sample, whatever the budget
+        g_memory_budget = 0;
+        uint64_t start_us = monotonic_us();
+        SoundPack *pack = load_sound_pack(config_path, 1);
+        if (!pack || decode_cache_result != 0) {
+            return 1;
+        }
+        printf("Pack cache %s\n", pack->store.mapping ? "already up to date" : "built");
+
+        // The catalog gives the time a start takes from now on, so load
+        // again from the cache just written, which also checks it
+        if (!pack->store.mapping) {
+            free_sound_pack(pack);
+            start_us = monotonic_us();
+            pack = load_sound_pack(config_path, 1);
+            if (!pack) {
+                return 1;
+            }
+        }
+        print_catalog_entry(pack, monotonic_us() - start_us);
+        free_sound_pack(pack);
+        return 0;
+    }
+
+    if (g_trace_path) {
+        if (key_trace_open(g_trace_path, "keyboard_sound_player") != 0) {
+            fprintf(stderr, "Warning: Tracing is disabled\n");
+        }
+        key_trace_thread(g_render_path ? "render" : "input");
+    }
+
+    if (g_render_path) {
+        if (!g_output || strcmp(g_output->name, "pulse") == 0 || strcmp(g_output->name, "alsa") == 0) {
+            fprintf(stderr, "Error: --render writes a file, use --output wav:FILE or flac:FILE\n");
+            return 1;
+        }
+        // Fallback sounds for keys not decoded yet would change the output
+        g_memory_budget = 0;
+        g_sound_pack = load_sound_pack(config_path, 1);
+        if (!g_sound_pack) {
+            fprintf(stderr, "Failed to load sound pack\n");
+            return 1;
+        }
+        int result = init_mix_engine() == 0 ? render_session(g_render_path) : -1;
+        cleanup();
+        return result == 0 ? 0 : 1;
+    }
+
+    // Before the decode workers and the mixer, so they inherit the blocked signals
+    if (init_stats_thread() != 0) {
+        return 1;
+    }
+
+    // Decoding carries on in the background while input starts
+    g_sound_pack = load_sound_pack(config_path, 0);
+    if (!g_sound_pack) {
+        fprintf(stderr, "Failed to load sound pack\n");
+        return 1;
+    }
+
+    if (init_mixer() != 0) {
+        fprintf(stderr, "Failed to start mixer\n");
+        return 1;
+    }
+
+    if (g_control_path && init_control(g_control_path) != 0) {
+        fprintf(stderr, "Warning: Control socket is disabled\n");
+    }
+    if (init_reload(config_path) != 0) {
+        fprintf(stderr, "Warning: Sound pack reloading is disabled\n");
+    }
+
+    // mechsim_bench waits for this line before sending events
+    mark_stats_ready();
+    printf("Keyboard sound player initialized. Listening for key events...\n");
+    fflush(stdout);
+
+#ifdef MECHSIM_INPROCESS
+    if (g_inprocess) {
+        int result = run_inprocess();
+        cleanup();
+        return result == 0 ? 0 : 1;
+    }
+#endif
+
+    fd_set readfds;
+    struct timeval timeout;
+    
+    // Read key events from stdin. Only verbose mode wakes up without
+    // input, to show it is still waiting.
+    while (1) {
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+        
+        timeout.tv_sec = 1;  // 1 second timeout
+        timeout.tv_usec = 0;
+        
+        int ready = select(STDIN_FILENO + 1, &readfds, NULL, NULL, g_verbose ? &timeout : NULL);
+        
+        if (ready == -1) {
             perror("select");
             break;
         } else if (ready == 0) {
@@ -618,19 +4586,13 @@ int main(int argc, char *argv[]) {
             continue;
         }
         
-        if (FD_ISSET(STDIN_FILENO, &readfds)) {
-            if (fgets(line, sizeof(line), stdin) == NULL) {
-                if (feof(stdin)) {
-                    printf("EOF reached on stdin\n");
-                } else {
-                    perror("fgets");
-                }
+        if (FD_ISSET(STDIN_FILENO, &readfds) && g_binary_input) {
+            if (read_binary_events() != 0) {
                 break;
             }
-            
-            int key_code, is_pressed;
-            if (parse_keyboard_event(line, &key_code, &is_pressed) == 0) {
-                play_sound_segment(key_code, is_pressed);
+        } else if (FD_ISSET(STDIN_FILENO, &readfds)) {
+            if (read_json_events() != 0) {
+                break;
             }
         }
     }
@@ -11,9 +11,57 @@
 #include <getopt.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 #define MAX_PATH_LENGTH 512
+#define MAX_PLAYER_ARGS 64
+#define MAX_DEVICES 8
+#define MAX_RENDER_PACKS 64
 #define AUDIO_BASE_DIR MECHSIM_DATA_DIR "/audio"
+#define CATALOG_HEADER "mechsim-catalog 1\n"
+
+// Settings passed through to the sound player
+typedef struct {
+    char *voices;
+    char *steal_policy;
+    char *resample_quality;
+    char *memory_budget;
+    char *retrigger;
+    char *key_voices;
+    char *max_event_rate;
+    char *realtime_priority;
+    char *mixer_cpu;
+    char *latency_ms;
+    char *schedule_ms;
+    char *idle_ms;
+    char *devices[MAX_DEVICES];   // --device for get_key_presses or the in-process player
+    int num_devices;
+    int lock_memory;
+    int binary;
+    int no_cache;
+    char stats_file[MAX_PATH_LENGTH];
+    char trace_file[MAX_PATH_LENGTH];
+    char render_trace[MAX_PATH_LENGTH];   // mechsim render, the session to mix
+    char control_socket[MAX_PATH_LENGTH];
+    char output[MAX_PATH_LENGTH + 8];
+    char volume[32];
+} PlayerOptions;
+
+// What the catalog knows about a pack, written by build_pack_caches from
+// what the player reports while compiling it
+typedef struct {
+    char name[256];           // directory in AUDIO_BASE_DIR
+    char display_name[128];   // from the config, may be empty
+    char mode[8];
+    int sounds;
+    unsigned long long pcm_bytes;
+    int source_rate;
+    unsigned long long load_us;   // start with the pack cache in place
+} CatalogEntry;
 
 // Global variables for cleanup
 pid_t keyboard_pid = 0;
@@ -25,17 +73,225 @@ void print_usage(const char *program_name) {
     printf("Options:\n");
     printf("  -s, --sound SOUND_NAME   Select sound pack (default: eg-oreo)\n");
     printf("  -V, --volume VOLUME      Set volume [0-100] (default: 50)\n");
+    printf("  -n, --voices COUNT       Sounds that can play at once (default: 10)\n");
+    printf("      --steal POLICY       When all voices are busy: none, oldest,\n");
+    printf("                           quietest or retrigger (default: oldest)\n");
+    printf("      --retrigger SPEC     What a key's new sound does to the ones it still plays:\n");
+    printf("                           overlap, cut, cap or release, for every key or as\n");
+    printf("                           KEY=POLICY, e.g. cut,57=overlap (default: overlap)\n");
+    printf("      --key-voices COUNT   Voices one key can play with --retrigger cap (default: 2)\n");
+    printf("      --max-event-rate N   Start at most N sounds per second (default: no limit)\n");
+    printf("      --mlock              Lock sample data and mixer state in memory\n");
+    printf("      --realtime PRIO      Run the mixer with SCHED_FIFO priority PRIO (1-99)\n");
+    printf("      --cpu N              Pin the mixer to CPU N\n");
+    printf("      --resample-quality Q fast, medium or best conversion of packs that are\n");
+    printf("                           not 48 kHz (default: medium)\n");
+    printf("      --memory-budget SIZE Keep at most SIZE of decoded sound, e.g. 4M\n");
+    printf("  -b, --binary             Pass key events as binary records instead of JSON\n");
+    printf("  -o, --output BACKEND     pulse[:SINK], alsa[:DEVICE], null[:unthrottled],\n");
+    printf("                           wav[:FILE] or flac[:FILE] (default: pulse)\n");
+    printf("      --latency-ms MS      Audio buffered ahead of what is heard, less uses more\n");
+    printf("                           CPU and risks underruns (default: 20)\n");
+    printf("      --schedule-ms MS     Start each sound MS after its key event, keeping the\n");
+    printf("                           rhythm of the typing; 0 plays as soon as possible\n");
+    printf("                           (default: 10)\n");
+    printf("      --idle-ms MS         Stop the output after MS without sound and sleep\n");
+    printf("                           until the next key; 0 keeps it running (default: 1000)\n");
+    printf("  -i, --inprocess          Read keys and play sounds in a single process\n");
+    printf("      --device PATH        Read this keyboard's evdev node instead of every\n");
+    printf("                           libinput device, auto for every keyboard (repeatable)\n");
+    printf("      --stats-file PATH    Write latency and voice stats here on exit\n");
+    printf("      --trace FILE         Write a Chrome trace of each keystroke through both\n");
+    printf("                           processes to FILE, open it in ui.perfetto.dev\n");
+    printf("      --no-cache           Decode the pack instead of using the pack cache\n");
+    printf("      --build-cache        Precompile every sound pack into the cache and\n");
+    printf("                           catalog them for --list\n");
+    printf("  -d, --daemon             Keep running in the background\n");
+    printf("      --socket PATH        Control socket (default: $XDG_RUNTIME_DIR/mechsim.sock)\n");
     printf("  -l, --list               List available sound packs\n");
+    printf("      --long               With --list, show each pack's mode, sounds, decoded\n");
+    printf("                           size, sample rate and load time\n");
     printf("  -h, --help               Show this help message\n");
     printf("  -v, --verbose            Enable verbose output\n");
     printf("\nExamples:\n");
     printf("  %s                       # Use default sound (eg-oreo)\n", program_name);
     printf("  %s -s cherrymx-blue-abs  # Use Cherry MX Blue ABS sound\n", program_name);
     printf("  %s -l                    # List all available sounds\n", program_name);
+    printf("\nRender recorded typing to audio files, faster than real time:\n");
+    printf("  %s render [OPTIONS] -s SOUND [-s SOUND ...] TRACE ...\n", program_name);
+    printf("                           Mix each TRACE, saved from get_key_presses, with each\n");
+    printf("                           SOUND into OUT_DIR/TRACE-SOUND.wav, in parallel\n");
+    printf("      --format FORMAT      wav or flac (default: wav)\n");
+    printf("      --out-dir DIR        Where the files go (default: .)\n");
+    printf("  -j, --jobs N             Render N files at once (default: one per core)\n");
+    printf("\nControl a running MechSim:\n");
+    printf("  %s ctl volume 40|+5|-5   Set the volume, or change it relative to now\n", program_name);
+    printf("  %s ctl mute|pause [on|off|toggle]\n", program_name);
+    printf("  %s ctl pack SOUND_NAME   Switch sound pack\n", program_name);
+    printf("  %s ctl reload|stats|quit\n", program_name);
+    printf("  %s ctl --socket PATH ... Talk to the MechSim listening on PATH\n", program_name);
     printf("\nPress Ctrl+C to exit.\n");
 }
 
-int list_sound_packs() {
+// Next tab separated field, fields may be empty
+static char *next_field(char **cursor) {
+    char *field = *cursor;
+    if (!field) return NULL;
+    char *end = strpbrk(field, "\t\n");
+    if (end && *end == '\t') {
+        *end = '\0';
+        *cursor = end + 1;
+    } else {
+        if (end) *end = '\0';
+        *cursor = NULL;
+    }
+    return field;
+}
+
+// Everything after the pack name, as printed by keyboard_sound_player --build-cache
+static int parse_catalog_fields(char *line, CatalogEntry *entry) {
+    char *fields[6];
+    for (int i = 0; i < 6; i++) {
+        if (!(fields[i] = next_field(&line))) return -1;
+    }
+    snprintf(entry->display_name, sizeof(entry->display_name), "%s", fields[0]);
+    snprintf(entry->mode, sizeof(entry->mode), "%s", fields[1]);
+    entry->sounds = atoi(fields[2]);
+    entry->pcm_bytes = strtoull(fields[3], NULL, 10);
+    entry->source_rate = atoi(fields[4]);
+    entry->load_us = strtoull(fields[5], NULL, 10);
+    return 0;
+}
+
+// Kept next to the pack caches, see the player's --cache-dir
+static int catalog_path(char *out, size_t size) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache_home && cache_home[0]) {
+        snprintf(out, size, "%s/mechsim/catalog", cache_home);
+    } else if (home && home[0]) {
+        snprintf(out, size, "%s/.cache/mechsim/catalog", home);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_catalog_entries(const void *a, const void *b) {
+    return strcmp(((const CatalogEntry *)a)->name, ((const CatalogEntry *)b)->name);
+}
+
+// The catalog sorted by name, or NULL when there is none or packs were
+// added or removed since it was built
+static CatalogEntry *load_catalog(int *count) {
+    char path[MAX_PATH_LENGTH];
+    struct stat catalog_st, audio_st;
+    if (catalog_path(path, sizeof(path)) != 0 || stat(path, &catalog_st) != 0 ||
+        stat(AUDIO_BASE_DIR, &audio_st) != 0 ||
+        audio_st.st_mtim.tv_sec > catalog_st.st_mtim.tv_sec ||
+        (audio_st.st_mtim.tv_sec == catalog_st.st_mtim.tv_sec &&
+         audio_st.st_mtim.tv_nsec >= catalog_st.st_mtim.tv_nsec)) {
+        return NULL;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return NULL;
+    }
+    char line[1024];
+    if (!fgets(line, sizeof(line), file) || strcmp(line, CATALOG_HEADER) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    CatalogEntry *entries = NULL;
+    int capacity = 0;
+    *count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CatalogEntry *grown = realloc(entries, capacity * sizeof(CatalogEntry));
+            if (!grown) {
+                free(entries);
+                fclose(file);
+                return NULL;
+            }
+            entries = grown;
+        }
+        char *cursor = line;
+        char *name = next_field(&cursor);
+        CatalogEntry *entry = &entries[*count];
+        if (name && name[0] && parse_catalog_fields(cursor, entry) == 0) {
+            snprintf(entry->name, sizeof(entry->name), "%s", name);
+            (*count)++;
+        }
+    }
+    fclose(file);
+
+    // An empty catalog is still a catalog
+    if (!entries) {
+        entries = malloc(sizeof(CatalogEntry));
+    }
+    return entries;
+}
+
+static int write_catalog(CatalogEntry *entries, int count) {
+    char path[MAX_PATH_LENGTH];
+    char temp_path[MAX_PATH_LENGTH + 8];
+    if (catalog_path(path, sizeof(path)) != 0) {
+        return -1;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Warning: Cannot write pack catalog: %s\n", path);
+        return -1;
+    }
+    qsort(entries, count, sizeof(CatalogEntry), compare_catalog_entries);
+    fputs(CATALOG_HEADER, file);
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "%s\t%s\t%s\t%d\t%llu\t%d\t%llu\n", entries[i].name, entries[i].display_name,
+                entries[i].mode, entries[i].sounds, entries[i].pcm_bytes, entries[i].source_rate,
+                entries[i].load_us);
+    }
+    if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Warning: Cannot write pack catalog: %s\n", path);
+        unlink(temp_path);
+        return -1;
+    }
+    printf("Wrote the catalog of %d sound packs to %s\n", count, path);
+    return 0;
+}
+
+static void print_catalog(const CatalogEntry *entries, int count, int long_format) {
+    printf("Available sound packs:\n");
+    printf("======================\n");
+    if (long_format) {
+        printf("  %-24s %-6s %6s %9s %9s %8s  %s\n",
+               "NAME", "MODE", "SOUNDS", "SIZE", "RATE", "LOAD", "DESCRIPTION");
+    }
+    for (int i = 0; i < count; i++) {
+        const CatalogEntry *entry = &entries[i];
+        if (!long_format) {
+            printf("  %s\n", entry->name);
+            continue;
+        }
+        printf("  %-24s %-6s %6d %6.1f MB %5.1f kHz %5.1f ms  %s\n", entry->name, entry->mode,
+               entry->sounds, entry->pcm_bytes / (1024.0 * 1024.0), entry->source_rate / 1000.0,
+               entry->load_us / 1000.0, entry->display_name);
+    }
+}
+
+int list_sound_packs(int long_format) {
+    int count;
+    CatalogEntry *catalog = load_catalog(&count);
+    if (catalog) {
+        print_catalog(catalog, count, long_format);
+        free(catalog);
+        return 0;
+    }
+
     DIR *dir;
     struct dirent *entry;
     char path[MAX_PATH_LENGTH];
@@ -66,10 +322,28 @@ int list_sound_packs() {
     }
 
     closedir(dir);
+    if (long_format) {
+        printf("\nRun 'mechsim --build-cache' to catalog the packs for --long.\n");
+    }
     return 0;
 }
 
 int validate_sound_pack(const char *sound_name) {
+    // An up to date catalog lists exactly the packs there are
+    int count;
+    CatalogEntry *catalog = load_catalog(&count);
+    if (catalog) {
+        CatalogEntry key;
+        snprintf(key.name, sizeof(key.name), "%s", sound_name);
+        int found = bsearch(&key, catalog, count, sizeof(CatalogEntry), compare_catalog_entries) != NULL;
+        free(catalog);
+        if (!found) {
+            fprintf(stderr, "Error: Sound pack '%s' not found in %s/\n", sound_name, AUDIO_BASE_DIR);
+            fprintf(stderr, "Use --list to see available sound packs.\n");
+        }
+        return found;
+    }
+
     char config_path[MAX_PATH_LENGTH];
     char sound_path[MAX_PATH_LENGTH];
     
@@ -110,6 +384,556 @@ void cleanup_processes(int sig) {
     exit(0);
 }
 
+// SIGHUP makes the player reload its sound pack
+void forward_reload(int sig) {
+    (void)sig;
+    if (sound_pid > 0) {
+        kill(sound_pid, SIGHUP);
+    }
+}
+
+// The player runs from the sound pack directory, so hand it absolute paths
+static void make_absolute_path(char *out, size_t size, const char *path) {
+    if (path[0] == '/' || !getcwd(out, size)) {
+        snprintf(out, size, "%s", path);
+        return;
+    }
+    size_t len = strlen(out);
+    snprintf(out + len, size - len, "/%s", path);
+}
+
+// Append the player's options and positional arguments, NULL terminated
+static int append_player_args(char **args, int count, PlayerOptions *options) {
+    if (options->voices) {
+        args[count++] = "--voices";
+        args[count++] = options->voices;
+    }
+    if (options->steal_policy) {
+        args[count++] = "--steal";
+        args[count++] = options->steal_policy;
+    }
+    if (options->resample_quality) {
+        args[count++] = "--resample-quality";
+        args[count++] = options->resample_quality;
+    }
+    if (options->retrigger) {
+        args[count++] = "--retrigger";
+        args[count++] = options->retrigger;
+    }
+    if (options->key_voices) {
+        args[count++] = "--key-voices";
+        args[count++] = options->key_voices;
+    }
+    if (options->max_event_rate) {
+        args[count++] = "--max-event-rate";
+        args[count++] = options->max_event_rate;
+    }
+    if (options->lock_memory) {
+        args[count++] = "--mlock";
+    }
+    if (options->realtime_priority) {
+        args[count++] = "--realtime";
+        args[count++] = options->realtime_priority;
+    }
+    if (options->mixer_cpu) {
+        args[count++] = "--cpu";
+        args[count++] = options->mixer_cpu;
+    }
+    if (options->memory_budget) {
+        args[count++] = "--memory-budget";
+        args[count++] = options->memory_budget;
+    }
+    if (options->binary) {
+        args[count++] = "--binary";
+    }
+    if (options->no_cache) {
+        args[count++] = "--no-cache";
+    }
+    if (options->render_trace[0]) {
+        args[count++] = "--render";
+        args[count++] = options->render_trace;
+    }
+    if (options->output[0]) {
+        args[count++] = "--output";
+        args[count++] = options->output;
+    }
+    if (options->latency_ms) {
+        args[count++] = "--latency-ms";
+        args[count++] = options->latency_ms;
+    }
+    if (options->schedule_ms) {
+        args[count++] = "--schedule-ms";
+        args[count++] = options->schedule_ms;
+    }
+    if (options->idle_ms) {
+        args[count++] = "--idle-ms";
+        args[count++] = options->idle_ms;
+    }
+    if (options->control_socket[0]) {
+        args[count++] = "--control-socket";
+        args[count++] = options->control_socket;
+    }
+    if (options->stats_file[0]) {
+        args[count++] = "--stats-file";
+        args[count++] = options->stats_file;
+    }
+    if (options->trace_file[0]) {
+        args[count++] = "--trace";
+        args[count++] = options->trace_file;
+    }
+    args[count++] = "config.json";
+    args[count++] = options->volume;
+    args[count] = NULL;
+    return count;
+}
+
+// Where the player listens for control commands unless --socket says otherwise
+static void default_socket_path(char *out, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir) {
+        snprintf(out, size, "%s/mechsim.sock", runtime_dir);
+    } else {
+        snprintf(out, size, "/tmp/mechsim-%d.sock", (int)getuid());
+    }
+}
+
+// mechsim ctl [--socket PATH] COMMAND [ARG]: send one command to the
+// running player and print its reply
+int run_control_client(int argc, char *argv[]) {
+    char socket_path[MAX_PATH_LENGTH];
+    default_socket_path(socket_path, sizeof(socket_path));
+    if (argc >= 2 && strcmp(argv[0], "--socket") == 0) {
+        snprintf(socket_path, sizeof(socket_path), "%s", argv[1]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1) {
+        fprintf(stderr, "Usage: mechsim ctl [--socket PATH] COMMAND [ARG]\n");
+        fprintf(stderr, "Run mechsim --help for the commands.\n");
+        return 1;
+    }
+
+    // The player takes a config path, the user gives a pack name
+    char command[MAX_PATH_LENGTH * 2];
+    if (strcmp(argv[0], "pack") == 0 && argc >= 2) {
+        if (!validate_sound_pack(argv[1])) {
+            return 1;
+        }
+        snprintf(command, sizeof(command), "pack %s/%s/config.json\n", AUDIO_BASE_DIR, argv[1]);
+    } else {
+        size_t length = 0;
+        for (int i = 0; i < argc && length < sizeof(command); i++) {
+            length += snprintf(command + length, sizeof(command) - length, "%s%s",
+                               argv[i], i + 1 < argc ? " " : "\n");
+        }
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Control socket path is too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: MechSim is not running (cannot connect to %s)\n", socket_path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (write(fd, command, strlen(command)) < 0) {
+        perror("write");
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char reply[4096];
+    ssize_t bytes;
+    int failed = -1;
+    while ((bytes = read(fd, reply, sizeof(reply))) > 0) {
+        if (failed < 0) {
+            failed = strncmp(reply, "error", bytes < 5 ? bytes : 5) == 0;
+        }
+        fwrite(reply, 1, bytes, stdout);
+    }
+    close(fd);
+    return failed == 0 ? 0 : 1;
+}
+
+// Return to the shell and carry on in the background. The session and its
+// terminal stay, sudo's cached credentials are tied to them.
+static int daemonize() {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid > 0) {
+        exit(0);
+    }
+
+    // Out of the shell's job, so Ctrl+C there does not reach us
+    setpgid(0, 0);
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    return 0;
+}
+
+// Point a root process at the invoking user's sound server
+static void export_pulse_environment() {
+    char value[MAX_PATH_LENGTH];
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    const char *home = getenv("HOME");
+
+    if (!getenv("PULSE_SERVER") && runtime_dir) {
+        snprintf(value, sizeof(value), "unix:%s/pulse/native", runtime_dir);
+        setenv("PULSE_SERVER", value, 0);
+    }
+    if (!getenv("PULSE_COOKIE") && home) {
+        snprintf(value, sizeof(value), "%s/.config/pulse/cookie", home);
+        if (access(value, R_OK) == 0) {
+            setenv("PULSE_COOKIE", value, 0);
+        }
+    }
+}
+
+// Run keyboard_sound_player_inprocess under sudo, it reads libinput itself
+static int start_inprocess_player(const char *player_path, const char *sound_dir,
+                                  PlayerOptions *options, int verbose) {
+    sound_pid = fork();
+    if (sound_pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    if (sound_pid == 0) {
+        if (chdir(sound_dir) != 0) {
+            perror("chdir");
+            exit(1);
+        }
+
+        if (verbose) {
+            fprintf(stderr, "Starting in-process sound player...\n");
+        }
+
+        export_pulse_environment();
+
+        char *args[MAX_PLAYER_ARGS];
+        int count = 0;
+        args[count++] = "sudo";
+        args[count++] = "-n";
+        args[count++] = "--preserve-env=PULSE_SERVER,PULSE_COOKIE";
+        args[count++] = (char *)player_path;
+        args[count++] = "--inprocess";
+        for (int i = 0; i < options->num_devices; i++) {
+            args[count++] = "--device";
+            args[count++] = options->devices[i];
+        }
+        append_player_args(args, count, options);
+
+        char sudo_path[256];
+        snprintf(sudo_path, sizeof(sudo_path), "%s/bin/sudo", PACKAGE_PREFIX);
+        execv(sudo_path, args);
+        perror("execv keyboard_sound_player_inprocess");
+        exit(1);
+    }
+
+    return 0;
+}
+
+// Compile every pack so later starts can map them instead of decoding,
+// and catalog them from what the player reports
+int build_pack_caches() {
+    char sound_player_path[MAX_PATH_LENGTH];
+    snprintf(sound_player_path, sizeof(sound_player_path), "%s/keyboard_sound_player", MECHSIM_BIN_DIR);
+
+    DIR *dir = opendir(AUDIO_BASE_DIR);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: Cannot open audio directory '%s'\n", AUDIO_BASE_DIR);
+        return 1;
+    }
+
+    struct dirent *entry;
+    int built = 0, failed = 0;
+    CatalogEntry *catalog = NULL;
+    int catalog_count = 0, catalog_capacity = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char sound_dir[MAX_PATH_LENGTH];
+        char config_path[MAX_PATH_LENGTH + 16];
+        snprintf(sound_dir, sizeof(sound_dir), "%s/%s", AUDIO_BASE_DIR, entry->d_name);
+        snprintf(config_path, sizeof(config_path), "%s/config.json", sound_dir);
+        if (access(config_path, R_OK) != 0)
+            continue;
+
+        printf("Building cache for %s...\n", entry->d_name);
+        fflush(stdout);
+
+        int output[2];
+        if (pipe(output) == -1) {
+            perror("pipe");
+            closedir(dir);
+            free(catalog);
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            closedir(dir);
+            free(catalog);
+            return 1;
+        }
+        if (pid == 0) {
+            close(output[0]);
+            dup2(output[1], STDOUT_FILENO);
+            close(output[1]);
+            if (chdir(sound_dir) != 0) {
+                perror("chdir");
+                exit(1);
+            }
+            execl(sound_player_path, "keyboard_sound_player", "--build-cache", "config.json", (char *)NULL);
+            perror("execl keyboard_sound_player");
+            exit(1);
+        }
+
+        // The player's own chatter is not interesting here, only its catalog line
+        close(output[1]);
+        CatalogEntry pack = {0};
+        int cataloged = 0;
+        FILE *player_output = fdopen(output[0], "r");
+        char line[1024];
+        while (player_output && fgets(line, sizeof(line), player_output)) {
+            if (strncmp(line, "Catalog\t", 8) == 0 && parse_catalog_fields(line + 8, &pack) == 0) {
+                cataloged = 1;
+            }
+        }
+        if (player_output) {
+            fclose(player_output);
+        } else {
+            close(output[0]);
+        }
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            built++;
+            if (cataloged && catalog_count == catalog_capacity) {
+                catalog_capacity = catalog_capacity ? catalog_capacity * 2 : 64;
+                CatalogEntry *grown = realloc(catalog, catalog_capacity * sizeof(CatalogEntry));
+                if (grown) {
+                    catalog = grown;
+                } else {
+                    cataloged = 0;
+                }
+            }
+            if (cataloged) {
+                snprintf(pack.name, sizeof(pack.name), "%s", entry->d_name);
+                catalog[catalog_count++] = pack;
+            }
+        } else {
+            fprintf(stderr, "Failed to build cache for %s\n", entry->d_name);
+            failed++;
+        }
+    }
+    closedir(dir);
+
+    printf("Built %d pack caches, %d failed\n", built, failed);
+    // A pack that failed to build is left out, so it is not offered either
+    write_catalog(catalog, catalog_count);
+    free(catalog);
+    return failed ? 1 : 0;
+}
+
+// One recorded session rendered with one pack
+typedef struct {
+    const char *trace;
+    const char *pack;
+    char output[MAX_PATH_LENGTH];
+    pid_t pid;
+} RenderJob;
+
+// Start a player that renders the job from the pack's directory
+static pid_t start_render(const char *player_path, const RenderJob *job, const PlayerOptions *options,
+                          const char *format, int verbose) {
+    PlayerOptions job_options = *options;
+    make_absolute_path(job_options.render_trace, MAX_PATH_LENGTH, job->trace);
+    snprintf(job_options.output, sizeof(job_options.output), "%s:%s", format, job->output);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        char sound_dir[MAX_PATH_LENGTH];
+        snprintf(sound_dir, sizeof(sound_dir), "%s/%s", AUDIO_BASE_DIR, job->pack);
+        if (chdir(sound_dir) != 0) {
+            perror("chdir");
+            exit(1);
+        }
+
+        // Many players chattering at once is noise, their errors still show
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            if (null_fd >= 0) {
+                dup2(null_fd, STDOUT_FILENO);
+                close(null_fd);
+            }
+        }
+
+        char *args[MAX_PLAYER_ARGS];
+        args[0] = "keyboard_sound_player";
+        append_player_args(args, 1, &job_options);
+        execv(player_path, args);
+        perror("execv keyboard_sound_player");
+        exit(1);
+    }
+    return pid;
+}
+
+// mechsim render: every trace with every pack into out_dir, running up to
+// jobs players at once. Each renders on a single thread, so one per core.
+int run_renders(char **traces, int num_traces, char **packs, int num_packs, const char *out_dir,
+                const char *format, int jobs, PlayerOptions *options, int verbose) {
+    char sound_player_path[MAX_PATH_LENGTH];
+    snprintf(sound_player_path, sizeof(sound_player_path), "%s/keyboard_sound_player", MECHSIM_BIN_DIR);
+    if (access(sound_player_path, X_OK) != 0) {
+        fprintf(stderr, "Error: Cannot find or execute %s\n", sound_player_path);
+        return 1;
+    }
+    if (strcmp(format, "wav") != 0 && strcmp(format, "flac") != 0) {
+        fprintf(stderr, "Error: Unknown format %s, use wav or flac\n", format);
+        return 1;
+    }
+    for (int i = 0; i < num_packs; i++) {
+        if (!validate_sound_pack(packs[i])) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_traces; i++) {
+        if (access(traces[i], R_OK) != 0) {
+            fprintf(stderr, "Error: Cannot read key event trace %s\n", traces[i]);
+            return 1;
+        }
+    }
+
+    char dir[MAX_PATH_LENGTH];
+    make_absolute_path(dir, sizeof(dir), out_dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s\n", dir);
+        perror("mkdir");
+        return 1;
+    }
+
+    int total = num_traces * num_packs;
+    RenderJob *render_jobs = calloc(total, sizeof(RenderJob));
+    if (!render_jobs) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < total; i++) {
+        RenderJob *job = &render_jobs[i];
+        job->trace = traces[i / num_packs];
+        job->pack = packs[i % num_packs];
+
+        // session.jsonl with holy-pandas goes to session-holy-pandas.wav
+        const char *name = strrchr(job->trace, '/');
+        name = name ? name + 1 : job->trace;
+        const char *dot = strrchr(name, '.');
+        int length = dot && dot != name ? (int)(dot - name) : (int)strlen(name);
+        if (snprintf(job->output, sizeof(job->output), "%s/%.*s-%s.%s",
+                     dir, length, name, job->pack, format) >= (int)sizeof(job->output)) {
+            fprintf(stderr, "Error: Output path too long for %s\n", job->trace);
+            free(render_jobs);
+            return 1;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("Rendering %d files, %d at a time...\n", total, jobs);
+    fflush(stdout);
+
+    int started = 0, running = 0, failed = 0;
+    while (started < total || running > 0) {
+        if (started < total && running < jobs) {
+            RenderJob *job = &render_jobs[started++];
+            job->pid = start_render(sound_player_path, job, options, format, verbose);
+            if (job->pid > 0) {
+                running++;
+            } else {
+                failed++;
+            }
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            perror("wait");
+            break;
+        }
+        for (int i = 0; i < started; i++) {
+            if (render_jobs[i].pid != pid) {
+                continue;
+            }
+            running--;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                printf("Rendered %s\n", render_jobs[i].output);
+            } else {
+                fprintf(stderr, "Failed to render %s with %s\n", render_jobs[i].trace, render_jobs[i].pack);
+                failed++;
+            }
+            fflush(stdout);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Rendered %d files, %d failed, in %.1f s\n", total - failed, failed,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    free(render_jobs);
+    return failed ? 1 : 0;
+}
+
+// Wait until a child exits, then take the other one down with it
+static void wait_for_children() {
+    int status;
+    pid_t finished_pid;
+    
+    // Wait for either child to exit
+    while ((finished_pid = wait(&status)) > 0) {
+        if (finished_pid == keyboard_pid) {
+            printf("Keyboard listener exited with status %d\n", WEXITSTATUS(status));
+            if (WIFSIGNALED(status)) {
+                printf("Keyboard listener killed by signal %d\n", WTERMSIG(status));
+            }
+            keyboard_pid = 0;
+            if (sound_pid > 0) {
+                kill(sound_pid, SIGTERM);
+            }
+        } else if (finished_pid == sound_pid) {
+            printf("Sound player exited with status %d\n", WEXITSTATUS(status));
+            if (WIFSIGNALED(status)) {
+                printf("Sound player killed by signal %d\n", WTERMSIG(status));
+            }
+            sound_pid = 0;
+            if (keyboard_pid > 0) {
+                kill(keyboard_pid, SIGTERM);
+            }
+        }
+    }
+    
+    printf("MechSim exited.\n");
+}
+
 // Function to check if sudo credentials are cached
 int check_sudo_cached() {
     int status = system("sudo -n true 2>/dev/null");
@@ -138,24 +962,79 @@ int main(int argc, char *argv[]) {
     char *sound_name = "eg-oreo"; // Default sound pack
     int verbose = 0;
     int list_sounds = 0;
+    int long_list = 0;
+    int build_cache = 0;
+    int background = 0;
+    int render = 0;
+    char *render_packs[MAX_RENDER_PACKS];
+    int num_render_packs = 0;
+    const char *render_format = "wav";
+    const char *render_dir = ".";
+    long render_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argc >= 2 && strcmp(argv[1], "ctl") == 0) {
+        return run_control_client(argc - 2, argv + 2);
+    }
+    // mechsim render takes the same options, and traces after them
+    if (argc >= 2 && strcmp(argv[1], "render") == 0) {
+        render = 1;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
     
     // Parse command line arguments
     static struct option long_options[] = {
         {"sound",   required_argument, 0, 's'},
         {"volume",  required_argument, 0, 'V'},
         {"list",    no_argument,       0, 'l'},
+        {"long",    no_argument,       0, 'L'},
         {"help",    no_argument,       0, 'h'},
         {"verbose", no_argument,       0, 'v'},
+        {"voices",  required_argument, 0, 'n'},
+        {"steal",   required_argument, 0, 'S'},
+        {"binary",  no_argument,       0, 'b'},
+        {"inprocess", no_argument,     0, 'i'},
+        {"device",  required_argument, 0, 'I'},
+        {"stats-file", required_argument, 0, 'T'},
+        {"trace",   required_argument, 0, 'Z'},
+        {"output",  required_argument, 0, 'o'},
+        {"latency-ms", required_argument, 0, 'D'},
+        {"schedule-ms", required_argument, 0, 'J'},
+        {"idle-ms", required_argument, 0, 'W'},
+        {"no-cache", no_argument,      0, 'N'},
+        {"resample-quality", required_argument, 0, 'Q'},
+        {"build-cache", no_argument,   0, 'B'},
+        {"memory-budget", required_argument, 0, 'M'},
+        {"retrigger", required_argument, 0, 'R'},
+        {"key-voices", required_argument, 0, 'K'},
+        {"max-event-rate", required_argument, 0, 'E'},
+        {"mlock",   no_argument,       0, 'm'},
+        {"realtime", required_argument, 0, 'P'},
+        {"cpu",     required_argument, 0, 'A'},
+        {"daemon",  no_argument,       0, 'd'},
+        {"socket",  required_argument, 0, 'U'},
+        {"format",  required_argument, 0, 'F'},
+        {"out-dir", required_argument, 0, 'O'},
+        {"jobs",    required_argument, 0, 'j'},
         {0, 0, 0, 0}
     };
 
     int volume = 50;
+    int inprocess = 0;
+    PlayerOptions player_options = {0};
     
     int opt;
-    while ((opt = getopt_long(argc, argv, "s:V:lhv", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "s:V:lhvn:bo:idj:", long_options, NULL)) != -1) {
         switch (opt) {
             case 's':
                 sound_name = optarg;
+                if (num_render_packs < MAX_RENDER_PACKS) {
+                    render_packs[num_render_packs++] = optarg;
+                } else if (render) {
+                    fprintf(stderr, "Error: At most %d sound packs\n", MAX_RENDER_PACKS);
+                    return 1;
+                }
                 break;
             case 'V':
                 volume = atoi(optarg);
@@ -165,12 +1044,108 @@ int main(int argc, char *argv[]) {
             case 'l':
                 list_sounds = 1;
                 break;
+            case 'L':
+                list_sounds = 1;
+                long_list = 1;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
             case 'v':
                 verbose = 1;
                 break;
+            case 'n':
+                player_options.voices = optarg;
+                break;
+            case 'S':
+                player_options.steal_policy = optarg;
+                break;
+            case 'b':
+                player_options.binary = 1;
+                break;
+            case 'i':
+                inprocess = 1;
+                break;
+            case 'T':
+                make_absolute_path(player_options.stats_file, MAX_PATH_LENGTH, optarg);
+                break;
+            case 'Z':
+                make_absolute_path(player_options.trace_file, MAX_PATH_LENGTH, optarg);
+                break;
+            case 'o':
+                if (strcmp(optarg, "wav") == 0 || strncmp(optarg, "wav:", 4) == 0) {
+                    char wav_path[MAX_PATH_LENGTH];
+                    make_absolute_path(wav_path, sizeof(wav_path), optarg[3] ? optarg + 4 : "mechsim.wav");
+                    snprintf(player_options.output, sizeof(player_options.output), "wav:%s", wav_path);
+                } else if (strcmp(optarg, "flac") == 0 || strncmp(optarg, "flac:", 5) == 0) {
+                    char flac_path[MAX_PATH_LENGTH];
+                    make_absolute_path(flac_path, sizeof(flac_path), optarg[4] ? optarg + 5 : "mechsim.flac");
+                    snprintf(player_options.output, sizeof(player_options.output), "flac:%s", flac_path);
+                } else {
+                    snprintf(player_options.output, sizeof(player_options.output), "%s", optarg);
+                }
+                break;
+            case 'N':
+                player_options.no_cache = 1;
+                break;
+            case 'Q':
+                player_options.resample_quality = optarg;
+                break;
+            case 'B':
+                build_cache = 1;
+                break;
+            case 'M':
+                player_options.memory_budget = optarg;
+                break;
+            case 'R':
+                player_options.retrigger = optarg;
+                break;
+            case 'K':
+                player_options.key_voices = optarg;
+                break;
+            case 'E':
+                player_options.max_event_rate = optarg;
+                break;
+            case 'm':
+                player_options.lock_memory = 1;
+                break;
+            case 'D':
+                player_options.latency_ms = optarg;
+                break;
+            case 'J':
+                player_options.schedule_ms = optarg;
+                break;
+            case 'W':
+                player_options.idle_ms = optarg;
+                break;
+            case 'I':
+                if (player_options.num_devices == MAX_DEVICES) {
+                    fprintf(stderr, "Error: At most %d devices\n", MAX_DEVICES);
+                    return 1;
+                }
+                player_options.devices[player_options.num_devices++] = optarg;
+                break;
+            case 'P':
+                player_options.realtime_priority = optarg;
+                break;
+            case 'A':
+                player_options.mixer_cpu = optarg;
+                break;
+            case 'd':
+                background = 1;
+                break;
+            case 'U':
+                make_absolute_path(player_options.control_socket, MAX_PATH_LENGTH, optarg);
+                break;
+            case 'F':
+                render_format = optarg;
+                break;
+            case 'O':
+                render_dir = optarg;
+                break;
+            case 'j':
+                render_jobs = atol(optarg);
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -179,7 +1154,35 @@ int main(int argc, char *argv[]) {
     
     // Handle list command
     if (list_sounds) {
-        return list_sound_packs();
+        return list_sound_packs(long_list);
+    }
+
+    if (build_cache) {
+        return build_pack_caches();
+    }
+
+    // Start the trace here, owned by the user, so every process appends to it
+    if (player_options.trace_file[0]) {
+        FILE *trace = fopen(player_options.trace_file, "w");
+        if (!trace) {
+            fprintf(stderr, "Error: Cannot write %s\n", player_options.trace_file);
+            return 1;
+        }
+        fputs("[\n", trace);
+        fclose(trace);
+    }
+
+    if (render) {
+        if (optind == argc) {
+            fprintf(stderr, "Usage: %s render [OPTIONS] -s SOUND [-s SOUND ...] TRACE ...\n", argv[0]);
+            return 1;
+        }
+        if (num_render_packs == 0) {
+            render_packs[num_render_packs++] = sound_name;
+        }
+        snprintf(player_options.volume, sizeof(player_options.volume), "%d", volume);
+        return run_renders(argv + optind, argc - optind, render_packs, num_render_packs, render_dir,
+                           render_format, render_jobs > 0 ? (int)render_jobs : 1, &player_options, verbose);
     }
     
     // Validate sound pack
@@ -195,23 +1198,43 @@ int main(int argc, char *argv[]) {
     // Check if required executables exist
     char get_key_presses_path[MAX_PATH_LENGTH];
     char sound_player_path[MAX_PATH_LENGTH];
+    char inprocess_player_path[MAX_PATH_LENGTH];
     
     snprintf(get_key_presses_path, sizeof(get_key_presses_path), "%s/get_key_presses", MECHSIM_BIN_DIR);
     snprintf(sound_player_path, sizeof(sound_player_path), "%s/keyboard_sound_player", MECHSIM_BIN_DIR);
+    snprintf(inprocess_player_path, sizeof(inprocess_player_path), "%s/keyboard_sound_player_inprocess", MECHSIM_BIN_DIR);
     
-    if (access(get_key_presses_path, X_OK) != 0) {
+    if (inprocess && access(inprocess_player_path, X_OK) != 0) {
+        fprintf(stderr, "Error: Cannot find or execute %s\n", inprocess_player_path);
+        return 1;
+    }
+
+    if (!inprocess && access(get_key_presses_path, X_OK) != 0) {
         fprintf(stderr, "Error: Cannot find or execute %s\n", get_key_presses_path);
         return 1;
     }
     
-    if (access(sound_player_path, X_OK) != 0) {
+    if (!inprocess && access(sound_player_path, X_OK) != 0) {
         fprintf(stderr, "Error: Cannot find or execute %s\n", sound_player_path);
         return 1;
     }
     
+    if (!player_options.control_socket[0]) {
+        default_socket_path(player_options.control_socket, MAX_PATH_LENGTH);
+    }
+
+    if (background) {
+        printf("MechSim running in the background with sound pack: %s\n", sound_name);
+        printf("Control it with '%s ctl', stop it with '%s ctl quit'.\n", argv[0], argv[0]);
+        if (daemonize() != 0) {
+            return 1;
+        }
+    }
+    
     // Setup signal handler for cleanup
     signal(SIGINT, cleanup_processes);
     signal(SIGTERM, cleanup_processes);
+    signal(SIGHUP, forward_reload);
     
     // Build paths
     char config_path[MAX_PATH_LENGTH];
@@ -230,6 +1253,16 @@ int main(int argc, char *argv[]) {
         printf("MechSim started with sound pack: %s\n", sound_name);
         printf("Press Ctrl+C to exit.\n");
     }
+
+    snprintf(player_options.volume, sizeof(player_options.volume), "%d", volume);
+
+    if (inprocess) {
+        if (start_inprocess_player(inprocess_player_path, sound_dir, &player_options, verbose) != 0) {
+            return 1;
+        }
+        wait_for_children();
+        return 0;
+    }
     
     // Create pipe for communication
     int pipefd[2];
@@ -263,10 +1296,12 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Starting sound player...\n");
         }
 
-        char volume_str[32];
-        snprintf(volume_str, sizeof(volume_str), "%d", volume);
-        execl(sound_player_path, "keyboard_sound_player", "config.json", volume_str, (char *)NULL);
-        perror("execl keyboard_sound_player");
+        char *player_argv[MAX_PLAYER_ARGS];
+        player_argv[0] = "keyboard_sound_player";
+        append_player_args(player_argv, 1, &player_options);
+
+        execv(sound_player_path, player_argv);
+        perror("execv keyboard_sound_player");
         exit(1);
     }
 
@@ -293,7 +1328,24 @@ int main(int argc, char *argv[]) {
         // Use -n flag to prevent sudo from prompting again (credentials should be cached)
         char sudo_path[256];
         snprintf(sudo_path, sizeof(sudo_path), "%s/bin/sudo", PACKAGE_PREFIX);
-        execl(sudo_path, "sudo", "-n", get_key_presses_path, (char *)NULL);
+        char *args[MAX_PLAYER_ARGS];
+        int count = 0;
+        args[count++] = "sudo";
+        args[count++] = "-n";
+        args[count++] = get_key_presses_path;
+        if (player_options.binary) {
+            args[count++] = "--binary";
+        }
+        for (int i = 0; i < player_options.num_devices; i++) {
+            args[count++] = "--device";
+            args[count++] = player_options.devices[i];
+        }
+        if (player_options.trace_file[0]) {
+            args[count++] = "--trace";
+            args[count++] = player_options.trace_file;
+        }
+        args[count] = NULL;
+        execv(sudo_path, args);
         perror("execl get_key_presses");
         exit(1);
     }
@@ -302,32 +1354,6 @@ int main(int argc, char *argv[]) {
     close(pipefd[0]);
     close(pipefd[1]);
     
-    int status;
-    pid_t finished_pid;
-    
-    // Wait for either child to exit
-    while ((finished_pid = wait(&status)) > 0) {
-        if (finished_pid == keyboard_pid) {
-            printf("Keyboard listener exited with status %d\n", WEXITSTATUS(status));
-            if (WIFSIGNALED(status)) {
-                printf("Keyboard listener killed by signal %d\n", WTERMSIG(status));
-            }
-            keyboard_pid = 0;
-            if (sound_pid > 0) {
-                kill(sound_pid, SIGTERM);
-            }
-        } else if (finished_pid == sound_pid) {
-            printf("Sound player exited with status %d\n", WEXITSTATUS(status));
-            if (WIFSIGNALED(status)) {
-                printf("Sound player killed by signal %d\n", WTERMSIG(status));
-            }
-            sound_pid = 0;
-            if (keyboard_pid > 0) {
-                kill(keyboard_pid, SIGTERM);
-            }
-        }
-    }
-    
-    printf("MechSim exited.\n");
+    wait_for_children();
     return 0;
 }
@@ -0,0 +1,592 @@
+#define _XOPEN_SOURCE 700
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <json-c/json.h>
+#include "key_event.h"
+
+#define MAX_PATH_LENGTH 512
+#define MAX_PLAYER_ARGS 32
+#define MAX_LINE_LENGTH 1024
+#define READY_LINE "Keyboard sound player initialized"
+#define BURST_KEYS 8           // keys per burst in the burst shape
+#define BURST_SPACING_US 25000
+#define HOLD_MIN_US 40000      // synthetic keys are held for 40-100ms
+#define HOLD_SPREAD_US 60000
+
+// One key event, offset from the start of the run
+typedef struct {
+    uint64_t offset_us;
+    int key_code;
+    int state;
+} BenchEvent;
+
+typedef struct {
+    BenchEvent *events;
+    size_t count, capacity;
+} EventList;
+
+typedef enum {
+    SHAPE_STEADY,      // evenly spaced
+    SHAPE_POISSON,     // random gaps, like ordinary typing
+    SHAPE_BURST        // runs of BURST_KEYS, then a pause
+} LoadShape;
+
+static const char *shape_names[] = { "steady", "poisson", "burst" };
+
+// What the player reported in its stats file
+typedef struct {
+    unsigned long long events;
+    unsigned long queue_full, no_voice, throttled, stolen, cut;
+    unsigned long long underruns;
+    double cpu_ms;
+    long long allocations;     // -1 when the counter was not loaded
+    unsigned long long latency_count, latency_p50, latency_p99, latency_max;
+} PlayerResult;
+
+// Letters, digits and space, weighted towards what people actually type
+static const int typing_keys[] = {
+    30, 48, 46, 32, 18, 33, 34, 35, 23, 36, 37, 38, 50, 49, 24, 25, 16, 19, 31, 20,
+    22, 47, 17, 45, 21, 44, 57, 57, 57, 57, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 28, 14
+};
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until_us(uint64_t deadline_us) {
+    struct timespec ts = {
+        .tv_sec = deadline_us / 1000000,
+        .tv_nsec = (deadline_us % 1000000) * 1000
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int add_event(EventList *list, uint64_t offset_us, int key_code, int state) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        BenchEvent *events = realloc(list->events, capacity * sizeof(BenchEvent));
+        if (!events) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        list->events = events;
+        list->capacity = capacity;
+    }
+    list->events[list->count++] = (BenchEvent){ offset_us, key_code, state };
+    return 0;
+}
+
+static int compare_events(const void *a, const void *b) {
+    const BenchEvent *ea = a, *eb = b;
+    if (ea->offset_us != eb->offset_us) return ea->offset_us < eb->offset_us ? -1 : 1;
+    return ea->state - eb->state;    // releases first when they coincide
+}
+
+// Load a get_key_presses JSON trace, keeping its original spacing
+static int load_trace(const char *path, EventList *list) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open trace: %s\n", path);
+        return -1;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    uint64_t first_us = 0;
+    int have_first = 0, line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        json_object *root = json_tokener_parse(line);
+        if (!root) {
+            fprintf(stderr, "Warning: Skipping invalid JSON on line %d\n", line_number);
+            continue;
+        }
+
+        json_object *key_obj, *state_obj, *time_obj;
+        if (!json_object_object_get_ex(root, "key_code", &key_obj) ||
+            !json_object_object_get_ex(root, "state_code", &state_obj)) {
+            json_object_put(root);
+            continue;
+        }
+
+        // Older traces only carry the millisecond time_stamp
+        uint64_t time_us = 0;
+        if (json_object_object_get_ex(root, "time_usec", &time_obj)) {
+            time_us = (uint64_t)json_object_get_int64(time_obj);
+        } else if (json_object_object_get_ex(root, "time_stamp", &time_obj)) {
+            time_us = (uint64_t)json_object_get_int64(time_obj) * 1000;
+        }
+        if (!have_first) {
+            first_us = time_us;
+            have_first = 1;
+        }
+
+        int result = add_event(list, time_us >= first_us ? time_us - first_us : 0,
+                               json_object_get_int(key_obj), json_object_get_int(state_obj));
+        json_object_put(root);
+        if (result != 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+
+    if (list->count == 0) {
+        fprintf(stderr, "Error: No key events in trace: %s\n", path);
+        return -1;
+    }
+    qsort(list->events, list->count, sizeof(BenchEvent), compare_events);
+    return 0;
+}
+
+// Generate presses at rate per second, each followed by its release
+static int generate_load(EventList *list, double rate, LoadShape shape, double seconds) {
+    uint64_t duration_us = (uint64_t)(seconds * 1000000);
+    double mean_gap_us = 1000000.0 / rate;
+    unsigned int seed = 1;     // fixed, so runs are comparable
+    uint64_t offset_us = 0;
+    int in_burst = 0;
+
+    while (offset_us < duration_us) {
+        int key_code = typing_keys[rand_r(&seed) % (sizeof(typing_keys) / sizeof(typing_keys[0]))];
+        uint64_t hold_us = HOLD_MIN_US + (uint64_t)(rand_r(&seed) % HOLD_SPREAD_US);
+        if (add_event(list, offset_us, key_code, 1) != 0 ||
+            add_event(list, offset_us + hold_us, key_code, 0) != 0) {
+            return -1;
+        }
+
+        switch (shape) {
+            case SHAPE_STEADY:
+                offset_us += (uint64_t)mean_gap_us;
+                break;
+            case SHAPE_POISSON: {
+                double uniform = (rand_r(&seed) + 1.0) / ((double)RAND_MAX + 2.0);
+                offset_us += (uint64_t)(-log(uniform) * mean_gap_us);
+                break;
+            }
+            case SHAPE_BURST:
+                // Keep the average rate, but spend it in tight runs
+                if (++in_burst < BURST_KEYS) {
+                    offset_us += BURST_SPACING_US < mean_gap_us ? BURST_SPACING_US : (uint64_t)mean_gap_us;
+                } else {
+                    in_burst = 0;
+                    double pause_us = mean_gap_us * BURST_KEYS - BURST_SPACING_US * (BURST_KEYS - 1);
+                    offset_us += pause_us > mean_gap_us ? (uint64_t)pause_us : (uint64_t)mean_gap_us;
+                }
+                break;
+        }
+    }
+
+    qsort(list->events, list->count, sizeof(BenchEvent), compare_events);
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t length) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Stamp each event as it is sent, so latency covers the player only
+static int send_event(int fd, const BenchEvent *event, int binary) {
+    uint64_t now_us = monotonic_us();
+
+    if (binary) {
+        struct key_event_record record = {
+            .time_usec = now_us,
+            .sent_usec = now_us,
+            .key_code = (uint16_t)event->key_code,
+            .state = (uint8_t)event->state
+        };
+        return write_all(fd, &record, sizeof(record));
+    }
+
+    char line[256];
+    int length = snprintf(line, sizeof(line),
+                          "{\"event_name\": \"KEYBOARD_KEY\", \"time_usec\": %llu, \"sent_usec\": %llu, "
+                          "\"key_code\": %d, \"state_code\": %d}\n",
+                          (unsigned long long)now_us, (unsigned long long)now_us,
+                          event->key_code, event->state);
+    return write_all(fd, line, length);
+}
+
+// Block until the player prints its ready line, 0 on success
+static int wait_until_ready(FILE *player_output, int verbose) {
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), player_output)) {
+        if (verbose) {
+            fputs(line, stderr);
+        }
+        if (strncmp(line, READY_LINE, strlen(READY_LINE)) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int read_player_stats(const char *path, PlayerResult *result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+
+    char line[MAX_LINE_LENGTH];
+    int found = 0;
+    result->allocations = -1;
+    while (fgets(line, sizeof(line), file)) {
+        char stage[32];
+        unsigned long long count, mean, p50, p99, max;
+        if (sscanf(line, " events: %llu", &result->events) == 1) {
+            found = 1;
+            continue;
+        }
+        if (sscanf(line, " dropped: %lu (queue full), %lu (no voice), %lu (rate limit), stolen: %lu, cut: %lu, underruns: %llu",
+                   &result->queue_full, &result->no_voice, &result->throttled, &result->stolen,
+                   &result->cut, &result->underruns) == 6) {
+            continue;
+        }
+        if (sscanf(line, " cpu: %lf ms, allocations: %lld", &result->cpu_ms, &result->allocations) >= 1) {
+            continue;
+        }
+        if (sscanf(line, " %31s %llu %llu %llu %llu %llu", stage, &count, &mean, &p50, &p99, &max) == 6 &&
+            strcmp(stage, "total") == 0) {
+            result->latency_count = count;
+            result->latency_p50 = p50;
+            result->latency_p99 = p99;
+            result->latency_max = max;
+        }
+    }
+    fclose(file);
+    return found ? 0 : -1;
+}
+
+// Run one pack through the player, 0 on success
+static int bench_pack(const char *pack_dir, const char *player, const char *alloc_lib,
+                      char **player_args, int num_player_args, const EventList *list,
+                      double speed, int binary, int verbose, PlayerResult *result, double *wall_seconds) {
+    char stats_path[] = "/tmp/mechsim-bench-XXXXXX";
+    int stats_fd = mkstemp(stats_path);
+    if (stats_fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    close(stats_fd);
+
+    int input_pipe[2], output_pipe[2];
+    if (pipe(input_pipe) != 0 || pipe(output_pipe) != 0) {
+        perror("pipe");
+        unlink(stats_path);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        unlink(stats_path);
+        return -1;
+    }
+
+    if (pid == 0) {
+        dup2(input_pipe[0], STDIN_FILENO);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        close(input_pipe[0]);
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+        close(output_pipe[1]);
+
+        if (chdir(pack_dir) != 0) {
+            perror("chdir");
+            exit(1);
+        }
+        if (alloc_lib) {
+            setenv("LD_PRELOAD", alloc_lib, 1);
+        }
+
+        char *argv[MAX_PLAYER_ARGS + 8];
+        int argc = 0;
+        argv[argc++] = (char *)player;
+        for (int i = 0; i < num_player_args; i++) {
+            argv[argc++] = player_args[i];
+        }
+        argv[argc++] = "--output";
+        argv[argc++] = "null";
+        argv[argc++] = "--stats-file";
+        argv[argc++] = stats_path;
+        if (binary) {
+            argv[argc++] = "--binary";
+        }
+        argv[argc++] = "config.json";
+        argv[argc] = NULL;
+
+        execv(player, argv);
+        perror("execv keyboard_sound_player");
+        exit(1);
+    }
+
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+    FILE *player_output = fdopen(output_pipe[0], "r");
+
+    int status = -1;
+    if (wait_until_ready(player_output, verbose) == 0) {
+        status = 0;
+        uint64_t start_us = monotonic_us();
+        for (size_t i = 0; i < list->count && status == 0; i++) {
+            if (speed > 0) {
+                sleep_until_us(start_us + (uint64_t)(list->events[i].offset_us / speed));
+            }
+            status = send_event(input_pipe[1], &list->events[i], binary);
+        }
+        *wall_seconds = (monotonic_us() - start_us) / 1000000.0;
+    }
+
+    // EOF makes the player drain its voices and write the stats file
+    close(input_pipe[1]);
+    char line[MAX_LINE_LENGTH];
+    while (fgets(line, sizeof(line), player_output)) {
+        if (verbose) {
+            fputs(line, stderr);
+        }
+    }
+    fclose(player_output);
+
+    int wait_status;
+    waitpid(pid, &wait_status, 0);
+    if (status == 0 && !(WIFEXITED(wait_status) && WEXITSTATUS(wait_status) == 0)) {
+        status = -1;
+    }
+    if (status == 0 && read_player_stats(stats_path, result) != 0) {
+        status = -1;
+    }
+    unlink(stats_path);
+    return status;
+}
+
+static void print_result(const char *pack, const PlayerResult *result, double wall_seconds) {
+    double events = result->events ? (double)result->events : 1.0;
+    char allocs[32];
+    if (result->allocations >= 0) {
+        snprintf(allocs, sizeof(allocs), "%.2f", result->allocations / events);
+    } else {
+        snprintf(allocs, sizeof(allocs), "-");
+    }
+
+    printf("%-24s %8llu %9.1f %9.2f %9s %8lu %8llu %8llu %8llu\n", pack,
+           result->events, wall_seconds > 0 ? result->events / wall_seconds : 0.0,
+           result->cpu_ms * 1000.0 / events, allocs,
+           result->queue_full + result->no_voice + result->throttled,
+           result->latency_p50, result->latency_p99, result->latency_max);
+}
+
+void print_usage(const char *program_name) {
+    printf("MechSim benchmark - replay key events through keyboard_sound_player\n\n");
+    printf("Usage: %s [OPTIONS] [-- PLAYER_OPTIONS]\n\n", program_name);
+    printf("Options:\n");
+    printf("  -t, --trace FILE         Replay a recorded get_key_presses JSON trace\n");
+    printf("  -r, --rate KEYS          Synthetic key presses per second (default: 10)\n");
+    printf("  -S, --shape SHAPE        steady, poisson or burst (default: poisson)\n");
+    printf("  -d, --duration SECONDS   Length of synthetic load (default: 5)\n");
+    printf("  -x, --speed FACTOR       Replay speed, 0 sends as fast as possible (default: 1)\n");
+    printf("  -s, --sound SOUND_NAME   Only benchmark this pack (default: all)\n");
+    printf("  -a, --audio DIR          Sound pack directory (default: audio)\n");
+    printf("  -p, --player PATH        Player binary (default: ./keyboard_sound_player)\n");
+    printf("  -A, --alloc-lib PATH     Allocation counter to preload (default: ./bench_alloc.so)\n");
+    printf("  -b, --binary             Send binary key event records instead of JSON\n");
+    printf("  -v, --verbose            Show player output\n");
+    printf("  -h, --help               Show this help message\n");
+    printf("\nRecord a trace with: sudo get_key_presses > trace.jsonl\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"trace",     required_argument, 0, 't'},
+        {"rate",      required_argument, 0, 'r'},
+        {"shape",     required_argument, 0, 'S'},
+        {"duration",  required_argument, 0, 'd'},
+        {"speed",     required_argument, 0, 'x'},
+        {"sound",     required_argument, 0, 's'},
+        {"audio",     required_argument, 0, 'a'},
+        {"player",    required_argument, 0, 'p'},
+        {"alloc-lib", required_argument, 0, 'A'},
+        {"binary",    no_argument,       0, 'b'},
+        {"verbose",   no_argument,       0, 'v'},
+        {"help",      no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    const char *trace_path = NULL;
+    const char *sound_name = NULL;
+    const char *audio_dir = "audio";
+    const char *player_path = "./keyboard_sound_player";
+    const char *alloc_lib_path = "./bench_alloc.so";
+    double rate = 10, duration = 5, speed = 1;
+    LoadShape shape = SHAPE_POISSON;
+    int binary = 0, verbose = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:r:S:d:x:s:a:p:A:bvh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'S': {
+                int found = 0;
+                for (int i = 0; i < (int)(sizeof(shape_names) / sizeof(shape_names[0])); i++) {
+                    if (strcmp(optarg, shape_names[i]) == 0) {
+                        shape = (LoadShape)i;
+                        found = 1;
+                    }
+                }
+                if (!found) {
+                    fprintf(stderr, "Unknown shape: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 's':
+                sound_name = optarg;
+                break;
+            case 'a':
+                audio_dir = optarg;
+                break;
+            case 'p':
+                player_path = optarg;
+                break;
+            case 'A':
+                alloc_lib_path = optarg;
+                break;
+            case 'b':
+                binary = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (rate <= 0 || duration <= 0 || speed < 0) {
+        fprintf(stderr, "Error: rate and duration must be positive, speed not negative\n");
+        return 1;
+    }
+    if (argc - optind > MAX_PLAYER_ARGS) {
+        fprintf(stderr, "Error: Too many player options\n");
+        return 1;
+    }
+
+    // The player runs from the pack directory, so make paths absolute
+    char player[MAX_PATH_LENGTH], alloc_lib[MAX_PATH_LENGTH];
+    if (!realpath(player_path, player)) {
+        fprintf(stderr, "Error: Player not found: %s\n", player_path);
+        return 1;
+    }
+    const char *preload = realpath(alloc_lib_path, alloc_lib) ? alloc_lib : NULL;
+    if (!preload) {
+        fprintf(stderr, "Warning: %s not found, allocations will not be counted\n", alloc_lib_path);
+    }
+
+    EventList list = {0};
+    if (trace_path ? load_trace(trace_path, &list) : generate_load(&list, rate, shape, duration)) {
+        free(list.events);
+        return 1;
+    }
+
+    DIR *dir = opendir(audio_dir);
+    if (!dir) {
+        fprintf(stderr, "Error: Cannot open audio directory '%s'\n", audio_dir);
+        free(list.events);
+        return 1;
+    }
+
+    // A broken player shows up as a failed pack, not a dead benchmark
+    signal(SIGPIPE, SIG_IGN);
+
+    if (trace_path) {
+        printf("Replaying %zu events from %s", list.count, trace_path);
+    } else {
+        printf("Synthetic load: %zu events, %.1f keys/s, %s", list.count, rate, shape_names[shape]);
+    }
+    if (speed > 0) {
+        printf(", %.1fx speed\n\n", speed);
+    } else {
+        printf(", unthrottled\n\n");
+    }
+    printf("%-24s %8s %9s %9s %9s %8s %8s %8s %8s\n", "pack", "events", "events/s",
+           "cpu us/ev", "allocs/ev", "dropped", "p50 us", "p99 us", "max us");
+
+    struct dirent *entry;
+    int failures = 0, packs = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        if (sound_name && strcmp(entry->d_name, sound_name) != 0) continue;
+
+        char pack_dir[MAX_PATH_LENGTH], config_path[MAX_PATH_LENGTH + sizeof("/config.json")];
+        struct stat st;
+        snprintf(pack_dir, sizeof(pack_dir), "%s/%s", audio_dir, entry->d_name);
+        snprintf(config_path, sizeof(config_path), "%s/config.json", pack_dir);
+        if (stat(config_path, &st) != 0) continue;
+
+        PlayerResult result = {0};
+        double wall_seconds = 0;
+        packs++;
+        if (bench_pack(pack_dir, player, preload, argv + optind, argc - optind, &list,
+                       speed, binary, verbose, &result, &wall_seconds) != 0) {
+            printf("%-24s failed\n", entry->d_name);
+            failures++;
+            continue;
+        }
+        print_result(entry->d_name, &result, wall_seconds);
+        fflush(stdout);
+    }
+    closedir(dir);
+    free(list.events);
+
+    if (packs == 0) {
+        fprintf(stderr, "Error: No sound packs found in %s\n", audio_dir);
+        return 1;
+    }
+    printf("\nLatency is from sending an event to its first samples leaving the mixer.\n");
+    return failures ? 1 : 0;
+}